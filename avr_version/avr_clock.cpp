@@ -0,0 +1,54 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "avr_clock.h"
+
+#ifndef F_CPU
+# error "Don't forget to specify F_CPU speed"
+#endif
+
+// Timer0 runs with /64 prescaler, 8bit counter overflows every 256 ticks
+#define CLOCK_US_PER_TICK (64 / (F_CPU / 1000000L))
+
+static volatile uint32_t timer0_overflows = 0;
+
+ISR(TIMER0_OVF_vect)
+{
+  timer0_overflows++;
+}
+
+void clock_begin()
+{
+  TCCR0A = 0; // normal mode
+  TCCR0B = _BV(CS01) | _BV(CS00); // clk/64
+  TIMSK0 |= _BV(TOIE0);
+  sei();
+}
+
+uint32_t micros()
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint32_t ovf = timer0_overflows;
+  uint8_t t = TCNT0;
+  // overflow happened after we disabled interrupts, but ISR did not run yet
+  if ((TIFR0 & _BV(TOV0)) && t < 255)
+    ovf++;
+  SREG = sreg;
+  return ((ovf << 8) + t) * CLOCK_US_PER_TICK;
+}
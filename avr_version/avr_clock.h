@@ -0,0 +1,32 @@
+#ifndef _AVR_CLOCK_H_
+#define _AVR_CLOCK_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+/* NOTE: same as with HardwareSerial, this is bare minimum of Arduino's micros()
+   for non-arduino AVR builds. It uses Timer0 overflow interrupt, so Timer0 can't
+   be used for anything else.
+*/
+
+// start Timer0, call it once before first micros() call
+void clock_begin();
+// microseconds since clock_begin(), wraps around every ~71 minutes
+uint32_t micros();
+
+#endif /* _AVR_CLOCK_H_ */
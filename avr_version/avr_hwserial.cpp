@@ -152,11 +152,17 @@ uint8_t HardwareSerial::read()
     return rxbuf.pop();
 }
 
-void HardwareSerial::write(const uint8_t *buf, int len)
+size_t HardwareSerial::write(const uint8_t *buf, int len)
 {
-    uint8_t start = !txbuf.length();
-    txbuf.store(buf, len);
-    if (start)
-      VESC_UCSRB |= (1 << VESC_UDRIE); 
+    // don't drop any part of the frame, wait for ISR to make space if needed
+    size_t written = len > 0 ? len : 0;
+    while (len > 0)
+    {
+      uint8_t stored = txbuf.store(buf, len);
+      buf += stored;
+      len -= stored;
+      VESC_UCSRB |= (1 << VESC_UDRIE);
+    }
+    return written;
 }
 
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "ringbuffer.h"
+#include "avr_clock.h"
 
 /* NOTE: do not use it for different projects, this is not complete drop in replacement
    for Arduino's HardwareSerial. This is bare minimum to allow same API and it implements
@@ -27,25 +28,34 @@
    does implement is 100 % compatible with the original.
 
    This class allows only one instance, no more.
+
+   Buffers are shared with USART interrupts, rx is filled by ISR and read by main loop,
+   tx the other way around, so they are lock-free SPSC ones.
 */
 
+// buffer sizes, have to be power of two, max. 128
+#ifndef VESC_UART_RXBUF
+# define VESC_UART_RXBUF 128
+#endif
+#ifndef VESC_UART_TXBUF
+# define VESC_UART_TXBUF 128
+#endif
+
 class HardwareSerial {
 public:
-  RingBuffer rxbuf;
-  RingBuffer txbuf;
-
-  HardwareSerial(uint8_t *rxbuf, int16_t rxbufsize, uint8_t *txbuf, int16_t txbufsize)
-    : rxbuf(rxbuf, rxbufsize), txbuf(txbuf, txbufsize)
-  {
+  SpscRingBuffer<VESC_UART_RXBUF> rxbuf;
+  SpscRingBuffer<VESC_UART_TXBUF> txbuf;
 
-  }
+  HardwareSerial() { }
 
   ~HardwareSerial() { }
 
   int begin(uint32_t baud);
   int available();
   uint8_t read();
-  void write(const uint8_t *buf, int len);
+  size_t readBytes(uint8_t *dst, size_t len) { return rxbuf.read(dst, len); }
+  size_t write(const uint8_t *buf, int len);
+  int availableForWrite() { return txbuf.freeSpace(); }
 };
 
 extern HardwareSerial vescuart;
@@ -74,9 +74,7 @@ void ledDebug(uint8_t long_, uint8_t short_, bool halt)
 }
 
 
-uint8_t uartrxbuf[100];
-uint8_t uarttxbuf[100];
-HardwareSerial vescuart(uartrxbuf, sizeof(uartrxbuf), uarttxbuf, sizeof(uarttxbuf));
+HardwareSerial vescuart;
 
 bool gotvalues;
 void valuesCB(VescUartApi *) { gotvalues = true; }
@@ -84,14 +82,16 @@ void valuesCB(VescUartApi *) { gotvalues = true; }
 int main()
 {
   int i;
-  uint8_t vescbuffer[128];
 
   LEDDDR |= _BV(LEDPIN);
 
   ledDebug(1,1,0);
 
-  //initialize vesc api with buffer and uart
-  VescUartApi vesc(vescbuffer, sizeof(vescbuffer), &vescuart);
+  //initialize vesc api with 128 B rx buffer and uart
+  VescUartApiStatic<128> vesc(&vescuart);
+
+  // micros() time source, used for timeouts
+  clock_begin();
 
   // initialize uart to VESC's default speed 115200 baud
   vesc.begin(115200);
@@ -0,0 +1,93 @@
+#ifndef _MPSCQUEUE_H_
+#define _MPSCQUEUE_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdint.h>
+#include "ringbuffer.h"
+
+/* Bounded multi-producer single-consumer queue of N items of T, N power of two.
+
+   Every cell has a sequence number telling whose turn it is: producers claim
+   a position with compare-and-swap and publish the item by bumping the cell's
+   sequence, consumer takes it and passes the cell to the producer one lap
+   later. No locks, no allocation; push() fails when queue is full.
+*/
+template <class T, uint32_t N>
+class MpscQueue {
+  static_assert(N && !(N & (N-1)), "MpscQueue size has to be power of two");
+
+  struct Cell {
+    uint32_t seq;
+    T item;
+  };
+  Cell cells[N];
+  RB_CACHELINE_ALIGN uint32_t enqueuePos;  // shared by producers
+  RB_CACHELINE_ALIGN uint32_t dequeuePos;  // consumer only
+
+public:
+  MpscQueue() : enqueuePos(0), dequeuePos(0)
+  {
+    for (uint32_t i = 0; i < N; ++i) cells[i].seq = i;
+  }
+
+  // any thread
+  bool push(const T &item)
+  {
+    uint32_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    Cell *cell;
+    for (;;)
+    {
+      cell = &cells[pos & (N-1)];
+      int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0)
+      {
+        if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          break;
+      }
+      else if (diff < 0)
+        return false;   // consumer did not free this cell yet, full
+      else
+        pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // consumer thread only
+  bool pop(T *item)
+  {
+    Cell *cell = &cells[dequeuePos & (N-1)];
+    if ((int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (dequeuePos+1)) < 0)
+      return false;
+    *item = cell->item;
+    __atomic_store_n(&cell->seq, dequeuePos + N, __ATOMIC_RELEASE);
+    dequeuePos++;
+    return true;
+  }
+
+  // consumer thread only, producer may be just publishing, so it's a hint
+  bool empty() const
+  {
+    return (int32_t)(__atomic_load_n(&cells[dequeuePos & (N-1)].seq, __ATOMIC_ACQUIRE) - (dequeuePos+1)) < 0;
+  }
+};
+
+#endif // _MPSCQUEUE_H_
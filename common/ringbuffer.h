@@ -17,59 +17,284 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+
 #include <string.h>
 #include <stdint.h>
-#include <stdlib.h>
 
+// no <type_traits> on AVR
+template <bool B, class T, class F> struct rb_conditional { typedef T type; };
+template <class T, class F> struct rb_conditional<false, T, F> { typedef F type; };
+
+// readable data of ring buffer, second block is non-empty only if data wraps around
+struct RingSpans {
+  const uint8_t *first;
+  uint32_t firstlen;
+  const uint8_t *second;
+  uint32_t secondlen;
+};
+
+template <class RB>
+uint32_t rb_copyout(const RingSpans &sp, uint8_t *dst, uint32_t maxlen, RB *rb)
+{
+  uint32_t n1 = (maxlen < sp.firstlen) ? maxlen : sp.firstlen;
+  uint32_t n2 = (maxlen - n1 < sp.secondlen) ? maxlen - n1 : sp.secondlen;
+  memcpy(dst, sp.first, n1);
+  memcpy(dst+n1, sp.second, n2);
+  rb->consume(n1+n2);
+  return n1+n2;
+}
+
+/* Ring buffer with static storage of N bytes, N has to be power of two.
+
+   head and tail are free running counters, position in buf is counter & mask,
+   so there is no wrap-around arithmetic and all N bytes are usable. Counter type
+   is the smallest one which can hold N, single byte on AVR for small buffers.
+*/
+template <uint32_t N>
 class RingBuffer {
+  static_assert(N && !(N & (N-1)), "RingBuffer size has to be power of two");
 public:
-  uint8_t *buf;
-  int16_t bufsize;
-  int16_t start;
-  int16_t len;
+  typedef typename rb_conditional<(N <= 128), uint8_t,
+          typename rb_conditional<(N <= 32768), uint16_t, uint32_t>::type>::type index_t;
+  static const index_t mask = N-1;
+
+  uint8_t buf[N];
+  index_t head;  // next byte is stored at head & mask
+  index_t tail;  // next byte is read from tail & mask
 
-  RingBuffer(uint8_t *buf, int16_t bufsize) : buf(buf), bufsize(bufsize), start(0), len(0) { }
+  RingBuffer() : head(0), tail(0) { }
 
-  RingBuffer(int16_t bufsize) : buf(NULL), bufsize(bufsize), start(0), len(0)
+  void store(const uint8_t *data, uint32_t datasize)
   {
-      buf = (uint8_t *)malloc(bufsize);
+    if (datasize > freeSpace())
+    {
+        //should not happen, not supported
+        // reset buffer to prevent deadlock
+        head = tail = 0;
+        // keep only what fits
+        if (datasize > N)
+        {
+          data += datasize - N;
+          datasize = N;
+        }
+    }
+    index_t pos = head & mask;
+    index_t endchunksize = N - pos;
+    if (datasize <= endchunksize)
+    {
+      memcpy(buf+pos, data, datasize);
+    }
+    else
+    {
+      memcpy(buf+pos, data, endchunksize);
+      memcpy(buf, data+endchunksize, datasize-endchunksize);
+    }
+    head += datasize;
   }
 
-  void store(const uint8_t *data, int16_t datasize)
+  void push(uint8_t b)
   {
-    if (datasize>freeSpace())
+    if (!freeSpace())
     {
         //should not happen, not supported
         // reset buffer to prevent deadlock
-        start = len = 0;
+        head = tail = 0;
     }
-    int16_t endchunksize = bufsize-(start+len);
-    if (datasize<=endchunksize)
+    buf[head++ & mask] = b;
+  }
+
+  uint8_t pop()
+  {
+    if (head == tail) return -1;
+    return buf[tail++ & mask];
+  }
+
+  inline index_t length() const { return (index_t)(head - tail); }
+  inline index_t freeSpace() const { return N - length(); }
+
+  /* Zero-copy access. Reader looks at data in place and then consume()s it,
+     writer gets free block, fills it (e.g. by read(2)) and then commit()s it.
+  */
+  index_t peekContiguous(const uint8_t **data) const
+  {
+    index_t pos = tail & mask;
+    index_t len = length();
+    *data = buf+pos;
+    return (len < N - pos) ? len : N - pos;
+  }
+  RingSpans readSpans() const
+  {
+    RingSpans sp;
+    sp.firstlen = peekContiguous(&sp.first);
+    sp.second = buf;
+    sp.secondlen = length() - sp.firstlen;
+    return sp;
+  }
+  void consume(index_t n) { tail += n; }
+  index_t freeContiguous(uint8_t **dst)
+  {
+    index_t pos = head & mask;
+    index_t space = freeSpace();
+    *dst = buf+pos;
+    return (space < N - pos) ? space : N - pos;
+  }
+  // both free blocks, second one is non-empty only if free space wraps around
+  index_t freeSpans(uint8_t **first, index_t *firstlen, uint8_t **second)
+  {
+    index_t space = freeSpace();
+    *firstlen = freeContiguous(first);
+    *second = buf;
+    return space;
+  }
+  void commit(index_t n) { head += n; }
+
+  // copies out up to maxlen bytes, returns how many
+  uint32_t read(uint8_t *dst, uint32_t maxlen)
+  {
+    RingSpans sp = readSpans();
+    return rb_copyout(sp, dst, maxlen, this);
+  }
+};
+
+// keep producer and consumer counters in different cache lines, no false sharing
+#if defined(__AVR__)
+# define RB_CACHELINE_ALIGN
+#else
+# define RB_CACHELINE_ALIGN alignas(64)
+#endif
+
+/* Lock-free single producer, single consumer variant of RingBuffer
+
+   For ISR -> main loop (AVR) or rx thread -> parser (Linux). Only producer writes
+   head, only consumer writes tail, each side reads the other one's counter with
+   acquire and publishes its own with release, so data written before head moves
+   is visible to consumer and space freed before tail moves can't be overwritten
+   too early. Unlike RingBuffer, full buffer is never reset (that would need to touch
+   tail from producer side), new data is dropped and counted in overruns instead.
+
+   On AVR, counters have to be single byte to be read/written atomically, so N <= 128.
+*/
+template <uint32_t N>
+class SpscRingBuffer {
+  static_assert(N && !(N & (N-1)), "SpscRingBuffer size has to be power of two");
+#if defined(__AVR__)
+  static_assert(N <= 128, "SpscRingBuffer on AVR needs single byte counters, N <= 128");
+#endif
+public:
+  typedef typename RingBuffer<N>::index_t index_t;
+  static const index_t mask = N-1;
+
+  uint8_t buf[N];
+  RB_CACHELINE_ALIGN index_t head;   // written by producer only
+  uint16_t overruns;                 // producer only, bytes dropped because buffer was full
+  RB_CACHELINE_ALIGN index_t tail;   // written by consumer only
+
+  SpscRingBuffer() : head(0), overruns(0), tail(0) { }
+
+  // producer side
+
+  inline index_t freeSpace() const
+  {
+    return N - (index_t)(head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+  }
+
+  bool push(uint8_t b)
+  {
+    index_t h = head;
+    if ((index_t)(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) == N)
     {
-      memcpy(buf+start+len, data, datasize);
-      len += datasize;
-      return;
+      overruns++;
+      return false;
+    }
+    buf[h & mask] = b;
+    __atomic_store_n(&head, (index_t)(h+1), __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // stores as much as fits, returns number of bytes stored, the rest is up to the caller
+  uint32_t store(const uint8_t *data, uint32_t datasize)
+  {
+    index_t h = head;
+    index_t space = freeSpace();
+    if (datasize > space) datasize = space;
+    index_t pos = h & mask;
+    index_t endchunksize = N - pos;
+    if (datasize <= endchunksize)
+    {
+      memcpy(buf+pos, data, datasize);
     }
     else
     {
-      if (endchunksize > 0)
-      {
-          memcpy(buf+start+len, data, endchunksize);
-          data += endchunksize;
-          datasize -= endchunksize;
-          len += endchunksize;
-          endchunksize = 0;
-      }
-      //negative endchunksize says how much abs(...) bytes at the beggining of the buffer is used, so shift '-endchunksize'
-      memcpy(buf-endchunksize/*endchunksize is negative*/, data, datasize);
-      len += datasize;
+      memcpy(buf+pos, data, endchunksize);
+      memcpy(buf, data+endchunksize, datasize-endchunksize);
     }
+    __atomic_store_n(&head, (index_t)(h+datasize), __ATOMIC_RELEASE);
+    return datasize;
   }
-  inline int16_t length() { return len; }
-  inline int16_t freeSpace() { return bufsize-len-1; }
-  uint8_t pop();
-  void push(uint8_t);
 
+  // consumer side
+
+  inline index_t length() const
+  {
+    return (index_t)(__atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail);
+  }
+
+  uint8_t pop()
+  {
+    index_t t = tail;
+    if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) return -1;
+    uint8_t ret = buf[t & mask];
+    __atomic_store_n(&tail, (index_t)(t+1), __ATOMIC_RELEASE);
+    return ret;
+  }
+
+  // zero-copy access, same as in RingBuffer, each call belongs to one side only
+
+  // consumer
+  index_t peekContiguous(const uint8_t **data) const
+  {
+    index_t pos = tail & mask;
+    index_t len = length();
+    *data = buf+pos;
+    return (len < N - pos) ? len : N - pos;
+  }
+  RingSpans readSpans() const
+  {
+    RingSpans sp;
+    index_t len = length();
+    index_t pos = tail & mask;
+    sp.first = buf+pos;
+    sp.firstlen = (len < N - pos) ? len : N - pos;
+    sp.second = buf;
+    sp.secondlen = len - sp.firstlen;
+    return sp;
+  }
+  void consume(index_t n) { __atomic_store_n(&tail, (index_t)(tail+n), __ATOMIC_RELEASE); }
+  uint32_t read(uint8_t *dst, uint32_t maxlen)
+  {
+    RingSpans sp = readSpans();
+    return rb_copyout(sp, dst, maxlen, this);
+  }
+
+  // producer
+  index_t freeContiguous(uint8_t **dst)
+  {
+    index_t pos = head & mask;
+    index_t space = freeSpace();
+    *dst = buf+pos;
+    return (space < N - pos) ? space : N - pos;
+  }
+  index_t freeSpans(uint8_t **first, index_t *firstlen, uint8_t **second)
+  {
+    // one tail snapshot for both blocks, so they are consistent
+    index_t pos = head & mask;
+    index_t space = freeSpace();
+    *first = buf+pos;
+    *firstlen = (space < N - pos) ? space : N - pos;
+    *second = buf;
+    return space;
+  }
+  void commit(index_t n) { __atomic_store_n(&head, (index_t)(head+n), __ATOMIC_RELEASE); }
 };
 
 #endif
@@ -0,0 +1,586 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "vescuartapi.h"
+#include "datatypes.h"
+#include "buffer.h"
+#include "crc.h"
+#include "ringbuffer.h"
+#include "linux_valuesbatch.h"
+
+/* Micro-benchmarks of the hot paths, results as JSON on stdout.
+   Iteration count is calibrated so one run takes about target time, reported
+   value is the median of BENCH_RUNS runs. Input data is generated from fixed
+   seed, so numbers are comparable from build to build.
+*/
+
+#define BENCH_RUNS 5
+#define BENCH_MAX 64
+// bytes written to the pipe before each loopstep(), has to fit default pipe size
+#define STREAM_BYTES 32768
+
+struct Result {
+  const char *name;
+  double ns_per_op;
+  double ns_per_byte;  // 0 if op has no natural byte size
+  uint64_t iterations;
+};
+
+static Result results[BENCH_MAX];
+static int nresults;
+static const char *filter;
+static double target_ns = 200e6;
+static volatile uint32_t sink;   // keeps results of measured code alive
+
+static uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t rnd = 0x12345678;
+static uint32_t nextRandom()
+{
+  // xorshift32, same sequence on every run
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 17;
+  rnd ^= rnd << 5;
+  return rnd;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* fn(ctx, iters) runs iters operations and returns nanoseconds they took,
+   so benchmarks can leave their setup out of the measurement.
+*/
+typedef uint64_t (*BenchFn)(void *ctx, uint64_t iters);
+
+static void bench(const char *name, BenchFn fn, void *ctx, double bytesPerOp, uint32_t opsPerIter = 1)
+{
+  if (filter && !strstr(name, filter)) return;
+  if (nresults == BENCH_MAX) return;
+
+  // calibrate, one run should take target / BENCH_RUNS
+  uint64_t iters = 1;
+  uint64_t took;
+  while ((took = fn(ctx, iters)) < target_ns / BENCH_RUNS / 4 && iters < (1ull << 40))
+    iters *= 2;
+  if (took)
+  {
+    double want = target_ns / BENCH_RUNS * iters / took;
+    if (want > iters) iters = (uint64_t)want;
+  }
+
+  double runs[BENCH_RUNS];
+  for (int r = 0; r < BENCH_RUNS; ++r)
+    runs[r] = (double)fn(ctx, iters) / (iters * opsPerIter);
+  qsort(runs, BENCH_RUNS, sizeof(runs[0]), cmpDouble);
+
+  Result *res = &results[nresults++];
+  res->name = name;
+  res->ns_per_op = runs[BENCH_RUNS/2];
+  res->ns_per_byte = bytesPerOp ? res->ns_per_op / bytesPerOp : 0;
+  res->iterations = iters * opsPerIter;
+  fprintf(stderr, "%-32s %10.2f ns/op %8.3f ns/B\n", name, res->ns_per_op, res->ns_per_byte);
+}
+
+// crc16
+
+struct CrcCtx {
+  uint8_t data[1024];
+  uint32_t len;
+};
+
+static uint64_t benchCrc(void *ctx, uint64_t iters)
+{
+  CrcCtx *c = (CrcCtx*)ctx;
+  uint32_t acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    c->data[0] = n;
+    acc += crc16(c->data, c->len);
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+// COMM_GET_VALUES payloads
+
+// motor current, erpm, input voltage and tachometer, typical control loop subset
+#define SELECTIVE_MASK (((uint32_t)1 << 2) | ((uint32_t)1 << 7) | ((uint32_t)1 << 8) | ((uint32_t)1 << 13))
+
+static int32_t encodeValues(uint8_t *dst, bool selective, uint32_t mask)
+{
+  int32_t index = 0;
+  dst[index++] = selective ? COMM_GET_VALUES_SELECTIVE : COMM_GET_VALUES;
+  if (selective) buffer_append_uint32(dst, mask, &index);
+  for (uint8_t f = 0; f < VALUE_FIELD_COUNT; ++f)
+  {
+    if (!(mask & ((uint32_t)1 << f))) continue;
+    for (uint8_t b = 0; b < vescValueFieldBytes[f]; ++b)
+      dst[index++] = nextRandom() & 0x7f;
+  }
+  return index;
+}
+
+static int32_t frame(uint8_t *dst, const uint8_t *payload, int32_t len)
+{
+  int32_t index = 0;
+  dst[index++] = 2;
+  dst[index++] = len;
+  memcpy(dst+index, payload, len);
+  index += len;
+  uint16_t crc = crc16((uint8_t*)payload, len);
+  dst[index++] = crc >> 8;
+  dst[index++] = crc & 0xff;
+  dst[index++] = 3;
+  return index;
+}
+
+struct Api {
+  HardwareSerial uart;
+  VescUartApiStatic<1024> vesc;
+  int wr;   // write end of the pipe uart reads from
+  Api() : uart("bench"), vesc(&uart), wr(-1) { }
+};
+
+struct ValuesCtx {
+  Api *api;
+  uint8_t payload[128];
+  int32_t len;
+};
+
+static uint64_t benchConsume(void *ctx, uint64_t iters)
+{
+  ValuesCtx *c = (ValuesCtx*)ctx;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+    c->api->vesc.consumePacket(c->payload, c->len);
+  uint64_t took = nowNs() - start;
+  sink = c->api->vesc.values_data.tachometer_value;
+  return took;
+}
+
+// loopstep() framing, stream is pushed through a pipe, read() is part of the cost
+
+struct StreamCtx {
+  Api *api;
+  uint8_t data[STREAM_BYTES];
+  uint32_t len;
+  uint32_t frames;
+};
+
+static void buildStream(StreamCtx *c, bool noisy)
+{
+  uint8_t payload[128];
+  uint8_t fr[140];
+  c->len = 0;
+  c->frames = 0;
+  for (;;)
+  {
+    int32_t plen = encodeValues(payload, false, 0xffffffff);
+    int32_t flen = frame(fr, payload, plen);
+    uint32_t garbage = 0;
+    if (noisy)
+    {
+      // 10 % frames preceded by line noise, 5 % with one byte damaged
+      if (nextRandom() % 10 == 0) garbage = 1 + nextRandom() % 16;
+      if (nextRandom() % 20 == 0) fr[nextRandom() % flen] ^= 1 << (nextRandom() % 8);
+    }
+    if (c->len + garbage + flen > sizeof(c->data)) break;
+    for (uint32_t g = 0; g < garbage; ++g)
+      c->data[c->len++] = nextRandom();
+    memcpy(c->data + c->len, fr, flen);
+    c->len += flen;
+    c->frames++;
+  }
+}
+
+static uint64_t benchLoopstep(void *ctx, uint64_t iters)
+{
+  StreamCtx *c = (StreamCtx*)ctx;
+  uint64_t took = 0;
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    if (write(c->api->wr, c->data, c->len) != (ssize_t)c->len)
+    {
+      printf("write to pipe failed: %m\n");
+      exit(1);
+    }
+    uint64_t start = nowNs();
+    // one call reads until the pipe is drained
+    c->api->vesc.loopstep();
+    took += nowNs() - start;
+  }
+  sink = c->api->vesc.rxPackets;
+  return took;
+}
+
+// VescValuesBatch, BATCH_ROWS payloads decoded to columns per iteration
+
+#define BATCH_ROWS 4096
+
+struct BatchCtx {
+  uint8_t payloads[BATCH_ROWS * 70];
+  float f[14][BATCH_ROWS];
+  int32_t tacho[2][BATCH_ROWS];
+  int8_t fault[BATCH_ROWS];
+  int8_t id[BATCH_ROWS];
+  ValuesColumns out;
+  const VescValuesBatch *batch;
+};
+
+static void fillBatch(BatchCtx *c, const VescValuesBatch *batch, bool selective, uint32_t mask)
+{
+  ValuesColumns *o = &c->out;
+  o->temp_fet = c->f[0];
+  o->temp_motor = c->f[1];
+  o->avg_motor_current = c->f[2];
+  o->avg_input_current = c->f[3];
+  o->avg_id = c->f[4];
+  o->avg_iq = c->f[5];
+  o->duty_cycle_now = c->f[6];
+  o->rpm = c->f[7];
+  o->input_voltage = c->f[8];
+  o->amp_hours = c->f[9];
+  o->amp_hours_charged = c->f[10];
+  o->watt_hours = c->f[11];
+  o->watt_hours_charged = c->f[12];
+  o->pid_pos = c->f[13];
+  o->tachometer_value = c->tacho[0];
+  o->tachometer_abs_value = c->tacho[1];
+  o->fault = c->fault;
+  o->controller_id = c->id;
+  c->batch = batch;
+  for (uint32_t r = 0; r < BATCH_ROWS; ++r)
+    encodeValues(c->payloads + r * batch->payloadBytes(), selective, mask);
+}
+
+static uint64_t benchBatch(void *ctx, uint64_t iters)
+{
+  BatchCtx *c = (BatchCtx*)ctx;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+    c->batch->decode(c->payloads, c->batch->payloadBytes(), BATCH_ROWS, &c->out);
+  uint64_t took = nowNs() - start;
+  sink = c->tacho[0][BATCH_ROWS-1];
+  return took;
+}
+
+// buffer codecs, 64 values per iteration
+
+#define CODEC_VALUES 64
+
+struct CodecCtx {
+  uint8_t buf[CODEC_VALUES * 4];
+  int32_t ints[CODEC_VALUES];
+  float floats[CODEC_VALUES];
+};
+
+static uint64_t benchAppendInt32(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      buffer_append_int32(c->buf, c->ints[v] + n, &index);
+    sink = c->buf[n & 0xff];
+  }
+  return nowNs() - start;
+}
+
+static uint64_t benchAppendFloat16(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      buffer_append_float16(c->buf, c->floats[v] + n, 10.0, &index);
+    sink = c->buf[n & 0x7f];
+  }
+  return nowNs() - start;
+}
+
+static uint64_t benchAppendFloat32(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      buffer_append_float32(c->buf, c->floats[v] + n, 100.0, &index);
+    sink = c->buf[n & 0xff];
+  }
+  return nowNs() - start;
+}
+
+static uint64_t benchGetInt32(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  int32_t acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    c->buf[0] = n;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      acc += buffer_get_int32(c->buf, &index);
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+static uint64_t benchGetFloat16(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  float acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    c->buf[0] = n;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      acc += buffer_get_float16(c->buf, 10.0, &index);
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+static uint64_t benchGetFloat32(void *ctx, uint64_t iters)
+{
+  CodecCtx *c = (CodecCtx*)ctx;
+  float acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    int32_t index = 0;
+    c->buf[0] = n;
+    for (int v = 0; v < CODEC_VALUES; ++v)
+      acc += buffer_get_float32(c->buf, 100.0, &index);
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+// sendCommandInplace(), uart writes to /dev/null
+
+struct SendCtx {
+  Api *api;
+  uint8_t buf[3 + 256 + 3];
+  int16_t cmdlen;
+  bool batched;
+};
+
+static uint64_t benchSend(void *ctx, uint64_t iters)
+{
+  SendCtx *c = (SendCtx*)ctx;
+  uint8_t batch[512];
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    if (c->batched) c->api->vesc.beginBatch(batch, sizeof(batch));
+    for (int k = 0; k < 8; ++k)
+    {
+      c->buf[3] = COMM_SET_CURRENT;
+      c->buf[4] = n + k;
+      c->api->vesc.sendCommandInplace(c->buf, c->cmdlen);
+    }
+    if (c->batched) c->api->vesc.endBatch();
+  }
+  return nowNs() - start;
+}
+
+// RingBuffer, 64 B stored and popped back per iteration
+
+struct RingCtx {
+  RingBuffer<4096> rb;
+  SpscRingBuffer<4096> spsc;
+  uint8_t chunk[64];
+};
+
+static uint64_t benchRing(void *ctx, uint64_t iters)
+{
+  RingCtx *c = (RingCtx*)ctx;
+  uint32_t acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    c->rb.store(c->chunk, sizeof(c->chunk));
+    for (uint32_t b = 0; b < sizeof(c->chunk); ++b)
+      acc += c->rb.pop();
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+static uint64_t benchSpsc(void *ctx, uint64_t iters)
+{
+  RingCtx *c = (RingCtx*)ctx;
+  uint32_t acc = 0;
+  uint64_t start = nowNs();
+  for (uint64_t n = 0; n < iters; ++n)
+  {
+    c->spsc.store(c->chunk, sizeof(c->chunk));
+    for (uint32_t b = 0; b < sizeof(c->chunk); ++b)
+      acc += c->spsc.pop();
+  }
+  uint64_t took = nowNs() - start;
+  sink = acc;
+  return took;
+}
+
+// big contexts live in .bss
+static CrcCtx crc;
+static Api rx;
+static StreamCtx stream;
+static ValuesCtx values;
+static BatchCtx batch;
+static CodecCtx codec;
+static Api tx;
+static SendCtx send;
+static RingCtx ring;
+
+static void printJson()
+{
+  printf("{\n  \"compiler\": \"%s\",\n  \"runs\": %d,\n  \"benchmarks\": [\n", __VERSION__, BENCH_RUNS);
+  for (int i = 0; i < nresults; ++i)
+  {
+    Result *r = &results[i];
+    printf("    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"ns_per_byte\": %.4f, \"iterations\": %llu}%s\n",
+           r->name, r->ns_per_op, r->ns_per_byte, (unsigned long long)r->iterations, i + 1 < nresults ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-t ms per benchmark] [-f name filter]\n"
+         "JSON results go to stdout, human readable summary to stderr\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "t:f:")) != -1)
+  {
+    switch (opt)
+    {
+      case 't': target_ns = atoi(optarg) * 1e6; break;
+      case 'f': filter = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || target_ns <= 0) usage(argv[0]);
+
+  for (uint32_t i = 0; i < sizeof(crc.data); ++i) crc.data[i] = nextRandom();
+  static const uint32_t crcSizes[] = {8, 64, 256, 1024};
+  static const char *crcNames[] = {"crc16/8", "crc16/64", "crc16/256", "crc16/1024"};
+  for (int i = 0; i < 4; ++i)
+  {
+    crc.len = crcSizes[i];
+    bench(crcNames[i], benchCrc, &crc, crc.len);
+  }
+
+  // rx side reads from a pipe
+  int fds[2];
+  if (pipe(fds) < 0)
+  {
+    printf("pipe failed: %m\n");
+    return 1;
+  }
+  rx.uart.attach(fds[0]);
+  rx.wr = fds[1];
+
+  stream.api = &rx;
+  buildStream(&stream, false);
+  bench("loopstep/clean", benchLoopstep, &stream, (double)stream.len / stream.frames, stream.frames);
+  buildStream(&stream, true);
+  bench("loopstep/noisy", benchLoopstep, &stream, (double)stream.len / stream.frames, stream.frames);
+
+  values.api = &rx;
+  values.len = encodeValues(values.payload, false, 0xffffffff);
+  bench("rcvd_GET_VALUES/full", benchConsume, &values, values.len);
+  values.len = encodeValues(values.payload, true, SELECTIVE_MASK);
+  bench("rcvd_GET_VALUES/selective", benchConsume, &values, values.len);
+
+  VescValuesBatch full, selective(SELECTIVE_MASK, true);
+  fillBatch(&batch, &full, false, 0xffffffff);
+  bench("values_batch/full", benchBatch, &batch, full.payloadBytes(), BATCH_ROWS);
+  fillBatch(&batch, &selective, true, SELECTIVE_MASK);
+  bench("values_batch/selective", benchBatch, &batch, selective.payloadBytes(), BATCH_ROWS);
+
+  for (int v = 0; v < CODEC_VALUES; ++v)
+  {
+    codec.ints[v] = nextRandom();
+    codec.floats[v] = (int32_t)nextRandom() / 1e6f;
+  }
+  for (uint32_t i = 0; i < sizeof(codec.buf); ++i) codec.buf[i] = nextRandom() & 0x7f;
+  bench("buffer_append_int32", benchAppendInt32, &codec, 4, CODEC_VALUES);
+  bench("buffer_append_float16", benchAppendFloat16, &codec, 2, CODEC_VALUES);
+  bench("buffer_append_float32", benchAppendFloat32, &codec, 4, CODEC_VALUES);
+  bench("buffer_get_int32", benchGetInt32, &codec, 4, CODEC_VALUES);
+  bench("buffer_get_float16", benchGetFloat16, &codec, 2, CODEC_VALUES);
+  bench("buffer_get_float32", benchGetFloat32, &codec, 4, CODEC_VALUES);
+
+  // tx side writes to /dev/null, cost of write() included
+  int null = open("/dev/null", O_WRONLY);
+  if (null < 0 || tx.uart.attach(null) < 0)
+  {
+    printf("can't open /dev/null: %m\n");
+    return 1;
+  }
+  send.api = &tx;
+  send.cmdlen = 5;
+  send.batched = false;
+  bench("sendCommandInplace/5", benchSend, &send, send.cmdlen + 6, 8);
+  send.cmdlen = 250;
+  bench("sendCommandInplace/250", benchSend, &send, send.cmdlen + 6, 8);
+  send.cmdlen = 5;
+  send.batched = true;
+  bench("sendCommandInplace/5/batch8", benchSend, &send, send.cmdlen + 6, 8);
+
+  for (uint32_t i = 0; i < sizeof(ring.chunk); ++i) ring.chunk[i] = nextRandom();
+  bench("RingBuffer/store_pop", benchRing, &ring, 1, sizeof(ring.chunk));
+  bench("SpscRingBuffer/store_pop", benchSpsc, &ring, 1, sizeof(ring.chunk));
+
+  printJson();
+  return 0;
+}
@@ -19,6 +19,9 @@
 #include <unistd.h>
 #include "linux_hwserial.h"
 #include "vescuartapi.h"
+#include "vescpoller.h"
+#include "vesckeepalive.h"
+#include "vescfaultlog.h"
 
 bool gotvalues;
 void valuesCB(VescUartApi *) { gotvalues = true; }
@@ -26,18 +29,21 @@ void valuesCB(VescUartApi *) { gotvalues = true; }
 int main(int argc, char *argv[])
 {
   int i;
-  uint8_t vescbuffer[1024];
 
   // use serial port specified as a command line argument or use default
   HardwareSerial uart(argc > 1 ? argv[1] : "/dev/ttyUSB0");
 
-  //initialize vesc api with buffer and uart
-  VescUartApi vesc(vescbuffer, sizeof(vescbuffer), &uart);
+  //initialize vesc api with 1 kB rx buffer and uart
+  VescUartApiStatic<1024> vesc(&uart);
 
   // initialize uart to VESC's default speed 115200 baud
   if (uart.begin(115200) < 0)
       exit(1);
 
+  // read serial port in background thread, loopstep() then only parses what it got
+  if (uart.startRxThread() < 0)
+      exit(1);
+
 #if 0
   // Loopback uart test. If you don't trust your adapter
   // Just connect usb-uart adapter and connect its RX to TX with jumper cable
@@ -86,35 +92,72 @@ int main(int argc, char *argv[])
   // valuesCB with set gotvalues flag, initialize it to false
   gotvalues = false;
 
-  vesc.askValues();
+  // ask for values as often as 115200 baud allows, leaving part of the link for setCurrent()
+  VescTelemetryPoller poller(&vesc, 115200);
+
+  // VESC stops the motor when it gets no command for a while, keepalive sends COMM_ALIVE
+  // in gaps, and stops the motor if we don't give new setpoint for 300 ms
+  VescTimerWheel wheel(10000);
+  VescKeepalive keepalive(&wheel, &vesc);
+  keepalive.appTimeout_us = 300000;
+  keepalive.start();
+
+  // remember faults, even those which clear before the next print
+  VescFaultLog faultlog(&vesc);
 
   //for 5 seconds...
-  for(i=50;i>0;--i)
+  for(i=5000;i>0;--i)
   {
     // process incomming data, if there are any
     vesc.loopstep();
+    // don't pile up telemetry requests in front of control commands when link is congested
+    if (!uart.txAboveHighWater())
+      poller.loopstep();
+    wheel.loopstep();
 
-    // if we got new COMM_GET_VALUES answer...
-    if (gotvalues)
+    // print and send setpoint every 100 ms, values are polled much faster
+    if (!(i%100))
     {
-      gotvalues = false;
-      printf("rpm: %d\nvoltage: %2.02f\ncurrent: %4.02f\nduty: %1.03f\n\n\n",
+      // everything sent in this block goes out in one write
+      VescBatch<64> batch(&vesc);
+
+      // if we got new COMM_GET_VALUES answer...
+      if (gotvalues)
+      {
+        gotvalues = false;
+        printf("rpm: %d\nvoltage: %2.02f\ncurrent: %4.02f\nduty: %1.03f\npolling: %u Hz\n\n\n",
 	     (int)vesc.values_data.rpm,
 	     vesc.values_data.input_voltage,
 	     vesc.values_data.avg_motor_current,
-	     vesc.values_data.duty_cycle_now);
-      vesc.askValues();
+	     vesc.values_data.duty_cycle_now,
+	     (unsigned)poller.rateHz());
+      }
+      //note: we have to send any command within VESC's timeout limit, or it will stop the motor
+//       vesc.setDuty(60000); // ~ 0.60
+      vesc.setCurrent(1234);  // ~ 1.234 A
     }
-    //note: we have to send any command within VESC's timeout limit, or it will stop the motor
-//     vesc.setDuty(60000); // ~ 0.60
-    vesc.setCurrent(1234);  // ~ 1.234 A
 
-    // limit rate to something sane
-    usleep(100000);
+    usleep(1000);
   }
 
+  printf("values: %lu requests, %lu replies, %lu late, %lu lost, rtt %lu us\n",
+         (unsigned long)poller.requests, (unsigned long)poller.replies, (unsigned long)poller.late,
+         (unsigned long)poller.lost, (unsigned long)poller.srtt_us);
+  printf("keepalives: %lu, failsafes: %lu\n", (unsigned long)keepalive.keepalives, (unsigned long)keepalive.failsafes);
+  VescFaultEvent faults[VESC_FAULT_HISTORY];
+  uint8_t nfaults = faultlog.read(faults, VESC_FAULT_HISTORY);
+  printf("faults: %lu\n", (unsigned long)faultlog.faults);
+  for (uint8_t f = 0; f < nfaults; ++f)
+    printf("  fault %d for %ld ms: %.2f A, %.2f V, %d rpm\n", faults[f].data.fault,
+           faults[f].cleared ? (long)(faults[f].clearedAt - faults[f].at) / 1000 : -1L,
+           faults[f].data.current, faults[f].data.voltage, (int)faults[f].data.rpm);
+  printf("rx: %llu B in %llu syscalls, %.1f B per syscall\n", (unsigned long long)uart.rxBytes,
+         (unsigned long long)uart.rxSyscalls, uart.bytesPerSyscall());
   printf("Stopping motor, before exit...\n");
   vesc.setCurrent(0);
+  // writes are non-blocking, make sure it's really sent
+  while (uart.txPending() && uart.flushTx() >= 0)
+    usleep(1000);
   sleep(1);
 
   return 0;
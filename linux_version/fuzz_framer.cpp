@@ -0,0 +1,184 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <time.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "vescuartapi.h"
+
+/* Fuzz harness of the framer, input is what comes over the line. Built with
+   -DVESC_LIBFUZZER -fsanitize=fuzzer it is a libFuzzer target, otherwise main()
+   runs it on files given as arguments or on stdin, which is what AFL needs.
+
+   Input goes through loopstep() twice, in big reads and in chunks of size picked by
+   its first byte, both have to give the same packets. With VESC_FUZZ_SCALING=<ratio>
+   in environment it also aborts when cost per byte of the input repeated to 64 KiB
+   is more than ratio times the cost of 16 KiB, i.e. when framing is superlinear.
+*/
+
+#define RXBUF 1024
+#define WHOLE_CHUNK 4096
+#define SCALE_SHORT 16384
+#define SCALE_LONG 65536
+#define SCALE_RUNS 3
+
+static HardwareSerial uart("fuzz");
+static int pipewr = -1;
+alignas(VescUartApiStatic<RXBUF>) static uint8_t apiStorage[sizeof(VescUartApiStatic<RXBUF>)];
+static double scalingRatio;
+
+struct Digest {
+  uint32_t packets;
+  uint64_t hash;
+};
+
+static void onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t size)
+{
+  Digest *d = (Digest*)ctx;
+  d->packets++;
+  // FNV-1a over packet sizes and contents
+  d->hash = (d->hash ^ size) * 0x100000001b3ull;
+  for (uint16_t i = 0; i < size; ++i)
+    d->hash = (d->hash ^ packet[i]) * 0x100000001b3ull;
+}
+
+static void init()
+{
+  int fds[2];
+  if (pipe(fds) < 0 || uart.attach(fds[0]) < 0)
+  {
+    printf("pipe failed: %m\n");
+    abort();
+  }
+  pipewr = fds[1];
+  const char *s = getenv("VESC_FUZZ_SCALING");
+  if (s) scalingRatio = atof(s);
+}
+
+static uint64_t cpuNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// fresh framer fed by chunks, returns CPU time spent in loopstep()
+static uint64_t run(const uint8_t *data, size_t len, size_t chunk, Digest *d)
+{
+  VescUartApi *vesc = new (apiStorage) VescUartApiStatic<RXBUF>(&uart);
+  VescPacketListener listener = { onPacket, d, nullptr };
+  d->packets = 0;
+  d->hash = 0xcbf29ce484222325ull;
+  vesc->addPacketListener(&listener);
+  uint64_t took = 0;
+  for (size_t fed = 0; fed < len; )
+  {
+    size_t n = len - fed < chunk ? len - fed : chunk;
+    if (write(pipewr, data + fed, n) != (ssize_t)n)
+    {
+      printf("write to pipe failed: %m\n");
+      abort();
+    }
+    fed += n;
+    uint64_t start = cpuNs();
+    vesc->loopstep();
+    took += cpuNs() - start;
+  }
+  vesc->removePacketListener(&listener);
+  return took;
+}
+
+static double costPerByte(const uint8_t *data, size_t datalen, size_t len)
+{
+  static uint8_t buf[SCALE_LONG];
+  Digest d;
+  for (size_t i = 0; i < len; ++i) buf[i] = data[i % datalen];
+  double best = 0;
+  for (int r = 0; r < SCALE_RUNS; ++r)
+  {
+    double c = (double)run(buf, len, WHOLE_CHUNK, &d) / len;
+    if (!r || c < best) best = c;
+  }
+  return best;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  if (pipewr < 0) init();
+  if (!size) return 0;
+
+  Digest whole, chunked;
+  size_t chunk = 1 + data[0] % 64;
+  run(data, size, WHOLE_CHUNK, &whole);
+  run(data, size, chunk, &chunked);
+  if ((whole.packets != chunked.packets || whole.hash != chunked.hash))
+  {
+    fprintf(stderr, "framing depends on read size: %u packets in one piece, %u in chunks of %u\n",
+            whole.packets, chunked.packets, (unsigned)chunk);
+    abort();
+  }
+
+  if (scalingRatio > 1)
+  {
+    double s = costPerByte(data, size, SCALE_SHORT);
+    double l = costPerByte(data, size, SCALE_LONG);
+    if (l > scalingRatio * s)
+    {
+      fprintf(stderr, "superlinear framing: %.2f ns/B on %u B, %.2f ns/B on %u B\n", s, SCALE_SHORT, l, SCALE_LONG);
+      abort();
+    }
+  }
+  return 0;
+}
+
+#if !defined(VESC_LIBFUZZER)
+static int runFile(FILE *f, const char *name)
+{
+  static uint8_t buf[1 << 20];
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  if (ferror(f))
+  {
+    printf("%s: read failed: %m\n", name);
+    return 1;
+  }
+  LLVMFuzzerTestOneInput(buf, len);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) return runFile(stdin, "stdin");
+  int ret = 0;
+  for (int i = 1; i < argc; ++i)
+  {
+    FILE *f = fopen(argv[i], "rb");
+    if (!f)
+    {
+      printf("%s: %m\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    ret |= runFile(f, argv[i]);
+    fclose(f);
+  }
+  return ret;
+}
+#endif
@@ -0,0 +1,176 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "vescuartapi.h"
+#include "vescfwupload.h"
+#include "vescfleetupdate.h"
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-a] [-c chunk size] [-w window] <serial port> <firmware.bin>\n"
+         "  -a  flash all controllers on CAN bus at once and verify them\n", name);
+  exit(1);
+}
+
+static int fleetUpdate(VescUartApi *vesc, const uint8_t *image, uint32_t imagesize, int chunk)
+{
+  VescFleetUpdate fleet(vesc);
+  if (chunk) fleet.upload.chunkSize = chunk;
+  if (!fleet.start(image, imagesize))
+  {
+    printf("Error: invalid chunk size\n");
+    return 1;
+  }
+
+  VescFleetUpdate::State last = VescFleetUpdate::FLEET_IDLE;
+  uint32_t lastprint = micros();
+  while (fleet.state() != VescFleetUpdate::FLEET_DONE && fleet.state() != VescFleetUpdate::FLEET_FAILED)
+  {
+    vesc->loopstep();
+    fleet.loopstep();
+    if (fleet.state() != last)
+    {
+      last = fleet.state();
+      if (last == VescFleetUpdate::FLEET_UPLOAD)
+        printf("Found %d CAN nodes, uploading...\n", fleet.nodeCount);
+      else if (last == VescFleetUpdate::FLEET_REBOOT)
+        printf("Uploaded %u B, %u B/s, rebooting all...\n", fleet.upload.bytesTotal(), fleet.upload.bytesPerSecond());
+      else if (last == VescFleetUpdate::FLEET_VERIFY_PING)
+        printf("Verifying...\n");
+    }
+    if (last == VescFleetUpdate::FLEET_UPLOAD && micros() - lastprint > 1000000)
+    {
+      lastprint = micros();
+      printf("%u / %u B, %u B/s, %u retransmits\n", fleet.upload.bytesDone(), fleet.upload.bytesTotal(),
+             fleet.upload.bytesPerSecond(), fleet.upload.retransmits);
+    }
+    usleep(200);
+  }
+
+  printf("local: firmware %d.%d %s\n", fleet.localFw[0], fleet.localFw[1], fleet.localVerified ? "OK" : "FAILED");
+  for (uint8_t i = 0; i < fleet.nodeCount; ++i)
+  {
+    VescFleetUpdate::Node *n = &fleet.nodes[i];
+    printf("CAN %3d: ", n->canId);
+    if (!n->seenAfter) printf("did not come back after reboot\n");
+    else if (!n->gotFw) printf("no firmware version answer\n");
+    else printf("firmware %d.%d %s\n", n->fw[0], n->fw[1], n->verified ? "OK" : "FAILED");
+  }
+  if (fleet.state() != VescFleetUpdate::FLEET_DONE)
+  {
+    printf("Error: fleet update failed, %d of %d CAN nodes verified\n", fleet.verifiedCount(), fleet.nodeCount);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t vescbuffer[1024];
+  bool allcan = false;
+  int chunk = 0, window = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ac:w:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'a': allcan = true; break;
+      case 'c': chunk = atoi(optarg); break;
+      case 'w': window = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2) usage(argv[0]);
+  const char *port = argv[optind];
+  const char *fwpath = argv[optind+1];
+
+  int fd = open(fwpath, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || !st.st_size)
+  {
+    printf("Error: Can't open firmware %s : %m\n", fwpath);
+    exit(1);
+  }
+  const uint8_t *image = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED)
+  {
+    printf("Error: Can't mmap firmware %s : %m\n", fwpath);
+    exit(1);
+  }
+  close(fd);
+  madvise((void *)image, st.st_size, MADV_SEQUENTIAL);
+
+  HardwareSerial uart(port);
+  VescUartApi vesc(vescbuffer, sizeof(vescbuffer), &uart);
+  if (uart.begin(115200) < 0)
+    exit(1);
+
+  if (allcan)
+  {
+    int ret = fleetUpdate(&vesc, image, st.st_size, chunk);
+    munmap((void *)image, st.st_size);
+    return ret;
+  }
+
+  VescFwUpload upload(&vesc);
+  if (chunk) upload.chunkSize = chunk;
+  if (window) upload.windowSize = window;
+
+  if (!upload.start(image, st.st_size))
+  {
+    printf("Error: invalid chunk size or window\n");
+    exit(1);
+  }
+  printf("Erasing...\n");
+
+  uint32_t lastprint = micros();
+  while (upload.state() == VescFwUpload::FWUP_ERASING || upload.state() == VescFwUpload::FWUP_WRITING)
+  {
+    vesc.loopstep();
+    upload.loopstep();
+    if (micros() - lastprint > 1000000)
+    {
+      lastprint = micros();
+      printf("%u / %u B, %u B/s, %u retransmits\n", upload.bytesDone(), upload.bytesTotal(),
+             upload.bytesPerSecond(), upload.retransmits);
+    }
+    usleep(200);
+  }
+
+  if (upload.state() != VescFwUpload::FWUP_DONE)
+  {
+    printf("Error: upload failed after %u B, %u retransmits, %u nacks\n",
+           upload.bytesDone(), upload.retransmits, upload.nacks);
+    exit(1);
+  }
+  printf("Uploaded %u B, %u B/s, %u retransmits, %u nacks\n", upload.bytesTotal(),
+         upload.bytesPerSecond(), upload.retransmits, upload.nacks);
+
+  // bootloader checks size and crc and flashes the new firmware
+  vesc.jumpToBootloader();
+  sleep(1);
+
+  munmap((void *)image, st.st_size);
+  return 0;
+}
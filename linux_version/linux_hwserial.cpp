@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include "linux_hwserial.h"
 
 #include <time.h>
@@ -89,6 +92,14 @@ int HardwareSerial::begin(int baud)
   return fd;
 }
 
+int HardwareSerial::attach(int newfd)
+{
+  int flags = fcntl(newfd, F_GETFL);
+  if (flags < 0 || fcntl(newfd, F_SETFL, flags | O_NONBLOCK) < 0) return -errno;
+  fd = newfd;
+  return fd;
+}
+
 void savePacket(bool in, const uint8_t *buf, int size)
 {
   return;
@@ -101,33 +112,243 @@ void savePacket(bool in, const uint8_t *buf, int size)
   close(fd);
 }
 
-int HardwareSerial::available()
+void HardwareSerial::markRead(uint32_t n, uint32_t now)
+{
+  rxIn += n;
+  __atomic_store_n(&fillAt, now, __ATOMIC_RELAXED);
+  uint8_t h = markHead;
+  // full, bytes of this read get time of the next marked one, or fillAt
+  if ((uint8_t)(h - __atomic_load_n(&markTail, __ATOMIC_ACQUIRE)) == VESC_RX_MARKS) return;
+  marks[h & (VESC_RX_MARKS-1)].end = rxIn;
+  marks[h & (VESC_RX_MARKS-1)].at = now;
+  __atomic_store_n(&markHead, (uint8_t)(h+1), __ATOMIC_RELEASE);
+}
+
+void HardwareSerial::takeMarks(uint32_t from, uint32_t to, uint32_t *firstAt, uint32_t *lastAt)
+{
+  uint8_t h = __atomic_load_n(&markHead, __ATOMIC_ACQUIRE);
+  uint8_t t = markTail;
+  *firstAt = *lastAt = __atomic_load_n(&fillAt, __ATOMIC_RELAXED);
+  bool gotFirst = false;
+  for (uint8_t i = t; i != h; ++i)
+  {
+    const RxMark *m = &marks[i & (VESC_RX_MARKS-1)];
+    if (!gotFirst && (int32_t)(m->end - from) > 0)
+    {
+      *firstAt = m->at;
+      gotFirst = true;
+    }
+    if ((int32_t)(m->end - to) >= 0)
+    {
+      *lastAt = m->at;
+      break;
+    }
+  }
+  dropMarks(h, to);
+}
+
+// reads taken completely are not needed anymore
+void HardwareSerial::dropMarks(uint8_t h, uint32_t to)
+{
+  uint8_t t = markTail;
+  while (t != h && (int32_t)(marks[t & (VESC_RX_MARKS-1)].end - to) <= 0) t++;
+  __atomic_store_n(&markTail, t, __ATOMIC_RELEASE);
+}
+
+void HardwareSerial::taken(uint32_t n)
+{
+  rxOut += n;
+  dropMarks(__atomic_load_n(&markHead, __ATOMIC_ACQUIRE), rxOut);
+}
+
+int HardwareSerial::fillBuffer()
 {
-  uint8_t rxbuf[100];
-  int maxlen;
+  struct iovec iov[2];
   int got;
-  while((maxlen=buf.freeSpace()))
+  int total = 0;
+  for(;;)
   {
-    if (maxlen > (int)sizeof(rxbuf)) maxlen = sizeof(rxbuf);
-    got = ::read(fd, rxbuf, maxlen);
+    // read straight into ring's free space, both blocks if it wraps around
+    uint8_t *first, *second;
+    SpscRingBuffer<4096>::index_t firstlen;
+    int space = buf.freeSpans(&first, &firstlen, &second);
+    if (!space) break;
+    iov[0].iov_base = first;
+    iov[0].iov_len = firstlen;
+    iov[1].iov_base = second;
+    iov[1].iov_len = space - firstlen;
+    got = ::readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    rxSyscalls++;
     if (got > 0)
     {
-      savePacket(true, rxbuf, got);
-      buf.store(rxbuf, got);
+      rxBytes += got;
+      // published by commit() below together with the data
+      markRead(got, micros());
+      if (got <= (int)firstlen) savePacket(true, first, got);
+      else
+      {
+        savePacket(true, first, firstlen);
+        savePacket(true, second, got - firstlen);
+      }
+      buf.commit(got);
+      total += got;
+      // short read, nothing more is waiting
+      if (got < space) break;
     }
     else break;
   }
+  return total;
+}
+
+int HardwareSerial::readInto(uint8_t *dst, size_t len)
+{
+  // leftovers first, they are older
+  uint32_t from = rxOut, leftAt = 0;
+  size_t have = buf.read(dst, len);
+  rxOut += have;
+  if (have) takeMarks(from, rxOut, &rxFirstAt, &leftAt);
+  if (rxthreadRunning || have == len)
+  {
+    if (have) rxLastAt = leftAt;
+    return have;
+  }
+  dst += have;
+  len -= have;
+
+  struct iovec iov[3];
+  uint8_t *first, *second;
+  SpscRingBuffer<4096>::index_t firstlen;
+  int space = buf.freeSpans(&first, &firstlen, &second);
+  iov[0].iov_base = dst;
+  iov[0].iov_len = len;
+  iov[1].iov_base = first;
+  iov[1].iov_len = firstlen;
+  iov[2].iov_base = second;
+  iov[2].iov_len = space - firstlen;
+  int iovcnt = iov[2].iov_len ? 3 : (iov[1].iov_len ? 2 : 1);
+
+  int got;
+  while((got = ::readv(fd, iov, iovcnt)) == -1 && errno==EINTR) {}
+  rxSyscalls++;
+  if (got <= 0)
+  {
+    if (have) rxLastAt = leftAt;
+    if (!got || errno == EAGAIN || errno == EWOULDBLOCK) return have;
+    return have ? have : -errno;
+  }
+  uint32_t now = micros();
+  if (!have) rxFirstAt = now;
+  rxLastAt = now;
+  rxBytes += got;
+  savePacket(true, dst, (size_t)got < len ? got : len);
+  if ((size_t)got <= len) return have + got;
+
+  // rest went to the ring, it was empty
+  markRead(got - len, now);
+  buf.commit(got - len);
+  return have + len;
+}
+
+int HardwareSerial::available()
+{
+  if (!rxthreadRunning) fillBuffer();
   return buf.length();
 }
 
+void *HardwareSerial::rxThreadMain(void *arg)
+{
+  HardwareSerial *self = (HardwareSerial *)arg;
+  struct pollfd pfd[2];
+  pfd[0].fd = self->wakefd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = self->fd;
+  pfd[1].events = POLLIN;
+  for(;;)
+  {
+    // buffer full, port would stay readable, so wait only for stop request and retry later
+    bool full = !self->buf.freeSpace();
+    if (poll(pfd, full ? 1 : 2, full ? 1 : -1) < 0 && errno != EINTR) break;
+    if (pfd[0].revents & POLLIN) break;
+    if (!full && (pfd[1].revents & (POLLERR|POLLHUP|POLLNVAL))) break;
+    if (!full) self->fillBuffer();
+  }
+  return NULL;
+}
+
+int HardwareSerial::startRxThread()
+{
+  if (rxthreadRunning) return 0;
+  if (fd < 0) return -EBADF;
+  wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakefd < 0) return -errno;
+  int err = pthread_create(&rxthread, NULL, rxThreadMain, this);
+  if (err)
+  {
+    close(wakefd);
+    wakefd = -1;
+    return -err;
+  }
+  rxthreadRunning = true;
+  return 0;
+}
+
+void HardwareSerial::stopRxThread()
+{
+  if (!rxthreadRunning) return;
+  uint64_t one = 1;
+  while(::write(wakefd, &one, sizeof(one)) == -1 && errno==EINTR) {}
+  pthread_join(rxthread, NULL);
+  close(wakefd);
+  wakefd = -1;
+  rxthreadRunning = false;
+}
+
 uint8_t HardwareSerial::read()
 {
-  return buf.pop();
+  if (!buf.length()) return -1;
+  uint8_t c = buf.pop();
+  taken(1);
+  return c;
+}
+
+size_t HardwareSerial::readBytes(uint8_t *dst, size_t len)
+{
+  size_t n = buf.read(dst, len);
+  if (n) taken(n);
+  return n;
 }
 
-void HardwareSerial::write(const uint8_t *buf, int len)
+size_t HardwareSerial::write(const uint8_t *buf, int len)
 {
+  if (len <= 0) return 0;
+  if ((uint32_t)len > txbuf.freeSpace())
+  {
+    txDropped++;
+    return 0;
+  }
   savePacket(false, buf, len);
-  while(::write(fd, buf, len) == -1 && errno==EINTR) {}
+  txbuf.store(buf, len);
+  flushTx();
+  return len;
+}
+
+int HardwareSerial::flushTx()
+{
+  if (!txbuf.length()) return 0;
+  RingSpans sp = txbuf.readSpans();
+  struct iovec iov[2];
+  iov[0].iov_base = (void *)sp.first;
+  iov[0].iov_len = sp.firstlen;
+  iov[1].iov_base = (void *)sp.second;
+  iov[1].iov_len = sp.secondlen;
+  int sent;
+  while((sent = ::writev(fd, iov, sp.secondlen ? 2 : 1)) == -1 && errno==EINTR) {}
+  txSyscalls++;
+  if (sent < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+  // partially sent frame stays at the head of the queue, rest goes next time
+  txbuf.consume(sent);
+  txBytes += sent;
+  return sent;
 }
 
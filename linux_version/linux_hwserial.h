@@ -20,8 +20,18 @@
 #include <cstdint>
 #include <cstring>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "ringbuffer.h"
 
+/* Arduino's micros(), monotonic microseconds, wraps around every ~71 minutes */
+inline uint32_t micros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)now.tv_sec*1000000UL + now.tv_nsec/1000;
+}
+
 
 /* NOTE: do not use it for different projects, this is not complete drop in replacement
    for Arduino's HardwareSerial. This is bare minimum to allow same API and it implements
@@ -29,25 +39,104 @@
    does implement is 100 % compatible with the original.
 */
 
+// reads whose bytes are still in rx ring, remembered to timestamp the bytes, power of two
+#define VESC_RX_MARKS 16
+
+// tx queue size, power of two
+#ifndef VESC_TX_QUEUE
+# define VESC_TX_QUEUE 8192
+#endif
+
 class HardwareSerial {
-  RingBuffer buf;
+  SpscRingBuffer<4096> buf;
+  RingBuffer<VESC_TX_QUEUE> txbuf;  // whole frames waiting for port to become writable
   int fd;
+  int wakefd;           // eventfd, wakes up rx thread to stop it
+  bool rxthreadRunning;
+  pthread_t rxthread;
+  uint32_t fillAt;      // micros() of last read into buf
+  // where each read into buf ended, in bytes ever stored, and when it was; single producer, single consumer
+  struct RxMark {
+    uint32_t end;
+    uint32_t at;
+  };
+  RxMark marks[VESC_RX_MARKS];
+  uint8_t markHead;     // producer only
+  uint8_t markTail;     // consumer only
+  uint32_t rxIn;        // bytes ever stored in buf, producer only
+  uint32_t rxOut;       // bytes ever taken from buf, consumer only
+
+  static void *rxThreadMain(void *arg);
+  int fillBuffer();     // producer side, moves data from port to buf
+  void markRead(uint32_t n, uint32_t now);  // producer, before n bytes are committed to buf
+  // consumer, after bytes from..to of the stream were taken from buf
+  void takeMarks(uint32_t from, uint32_t to, uint32_t *firstAt, uint32_t *lastAt);
+  void dropMarks(uint8_t head, uint32_t to);
+  void taken(uint32_t n);  // consumer, n bytes were taken from buf without timestamps
 public:
-  HardwareSerial(const char *path) : buf(256), fd(-1)
+  // rx statistics, to check reads are really batched
+  uint64_t rxBytes;
+  uint64_t rxSyscalls;
+  /* micros() when first and last byte returned by last readInto() were read. tty
+     has no kernel timestamps, so it's the read() which got them, with rx thread
+     running the read done by the thread right after poll() woke it up.
+  */
+  uint32_t rxFirstAt;
+  uint32_t rxLastAt;
+  // tx statistics
+  uint64_t txBytes;
+  uint64_t txSyscalls;
+  uint32_t txDropped;    // frames refused, tx queue was full
+  // queued bytes above this -> txAboveHighWater(), time to stop asking for telemetry
+  uint32_t txHighWater;
+
+  HardwareSerial(const char *path) : fd(-1), wakefd(-1), rxthreadRunning(false), fillAt(0), markHead(0), markTail(0),
+    rxIn(0), rxOut(0), rxBytes(0), rxSyscalls(0),
+    rxFirstAt(0), rxLastAt(0),
+    txBytes(0), txSyscalls(0), txDropped(0), txHighWater(VESC_TX_QUEUE/4)
   {
       /* before we open port, use buffer for storing port path */
-      strncpy((char*)buf.buf, path, sizeof(buf.buf));
+      strncpy((char*)buf.buf, path, sizeof(buf.buf)-1);
+      buf.buf[sizeof(buf.buf)-1] = 0;
   }
 
   ~HardwareSerial()
   {
+      stopRxThread();
       if (fd>=0) close(fd);
   }
 
   int begin(int baud);
+  /* Use already open descriptor (pipe, socket, pty master, ...) instead of the
+     path, no termios setup. Serial takes ownership of it.
+  */
+  int attach(int fd);
+  /* Read port from dedicated thread, call after begin(). available()/read() then only
+     consume what rx thread stored in lock-free SPSC buffer, they never touch the port.
+  */
+  int startRxThread();
+  void stopRxThread();
   int available();
   uint8_t read();
-  void write(const uint8_t *buf, int len);
+  size_t readBytes(uint8_t *dst, size_t len);
+  /* Direct read path, not in Arduino's API: reads port straight into dst with one
+     readv(), whatever does not fit goes to internal buffer for the next call.
+     Returns bytes stored in dst, 0 if there is nothing to read, -errno on error.
+     With rx thread running, it just copies from internal buffer.
+  */
+  int readInto(uint8_t *dst, size_t len);
+  // for poll()/epoll, port is readable -> call VescUartApi::loopstep()
+  int handle() const { return fd; }
+  double bytesPerSyscall() const { return rxSyscalls ? (double)rxBytes/rxSyscalls : 0; }
+  /* Queues whole frame and tries to send it right away, never blocks. Frame is
+     refused as a whole (returns 0) if it does not fit, it's never truncated.
+  */
+  size_t write(const uint8_t *buf, int len);
+  // sends as much of tx queue as port takes, one writev(), call it when port is writable
+  int flushTx();
+  uint32_t txPending() const { return txbuf.length(); }
+  bool txAboveHighWater() const { return txbuf.length() > txHighWater; }
+  int availableForWrite() const { return txbuf.freeSpace(); }
 };
 
 #endif /* _LINUX_HWSERIAL_H_ */
@@ -0,0 +1,333 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "linux_iothread.h"
+#include "datatypes.h"
+
+VescThreadedPort::VescThreadedPort(const char *path)
+  : uart(path), valuesSeq(0), io(nullptr), events(0), steppedAt(0), hungUp(false), vesc(&uart), submitted(0), queueFull(0)
+{
+  valuesListener.cb = onPacket;
+  valuesListener.ctx = this;
+  valuesListener.next = nullptr;
+  vesc.addPacketListener(&valuesListener);
+}
+
+void VescThreadedPort::onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t)
+{
+  if (packet[0] != COMM_GET_VALUES && packet[0] != COMM_GET_VALUES_SELECTIVE) return;
+  // seqlock, single writer
+  VescThreadedPort *p = (VescThreadedPort*)ctx;
+  uint32_t seq = p->valuesSeq;
+  __atomic_store_n(&p->valuesSeq, seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&p->snapshot, &vesc->values_data, sizeof(p->snapshot));
+  __atomic_store_n(&p->valuesSeq, seq+2, __ATOMIC_RELEASE);
+}
+
+bool VescThreadedPort::values(ValuesData *out, uint32_t *seqOut) const
+{
+  uint32_t seq;
+  do
+  {
+    seq = __atomic_load_n(&valuesSeq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    memcpy(out, &snapshot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || __atomic_load_n(&valuesSeq, __ATOMIC_RELAXED) != seq);
+  if (seqOut) *seqOut = seq / 2;
+  return seq != 0;
+}
+
+bool VescThreadedPort::submit(const Cmd &cmd)
+{
+  if (!queue.push(cmd))
+  {
+    __atomic_fetch_add(&queueFull, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  __atomic_fetch_add(&submitted, 1, __ATOMIC_RELAXED);
+  // pairs with the store in run(): either the thread sees the command or we see it sleeping
+  if (io && __atomic_load_n(&io->sleeping, __ATOMIC_SEQ_CST)) io->wake();
+  return true;
+}
+
+bool VescThreadedPort::submitValue(uint8_t op, int32_t value)
+{
+  Cmd cmd;
+  cmd.op = op;
+  cmd.len = 0;
+  cmd.value = value;
+  cmd.ptr = nullptr;
+  cmd.done = nullptr;
+  return submit(cmd);
+}
+
+bool VescThreadedPort::sendCommand(const uint8_t *payload, uint8_t len)
+{
+  if (len > VESC_MT_PAYLOAD) return false;
+  Cmd cmd;
+  cmd.op = OP_COMMAND;
+  cmd.len = len;
+  cmd.value = 0;
+  cmd.ptr = nullptr;
+  cmd.done = nullptr;
+  memcpy(cmd.payload, payload, len);
+  return submit(cmd);
+}
+
+bool VescThreadedPort::subscribe(VescPacketListener *listener)
+{
+  Cmd cmd;
+  cmd.op = OP_SUBSCRIBE;
+  cmd.len = 0;
+  cmd.value = 0;
+  cmd.ptr = listener;
+  cmd.done = nullptr;
+  return submit(cmd);
+}
+
+bool VescThreadedPort::unsubscribe(VescPacketListener *listener)
+{
+  if (!io || !__atomic_load_n(&io->running, __ATOMIC_ACQUIRE))
+  {
+    vesc.removePacketListener(listener);
+    return true;
+  }
+  uint32_t done = 0;
+  Cmd cmd;
+  cmd.op = OP_UNSUBSCRIBE;
+  cmd.len = 0;
+  cmd.value = 0;
+  cmd.ptr = listener;
+  cmd.done = &done;
+  while (!submit(cmd)) usleep(100);
+  while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) usleep(100);
+  return true;
+}
+
+void VescThreadedPort::execute(const Cmd &cmd)
+{
+  switch (cmd.op)
+  {
+    case OP_SET_CURRENT: vesc.setCurrent(cmd.value); break;
+    case OP_SET_CURRENT_BRAKE: vesc.setCurrentBrake(cmd.value); break;
+    case OP_SET_DUTY: vesc.setDuty(cmd.value); break;
+    case OP_SET_RPM: vesc.setRPM(cmd.value); break;
+    case OP_ASK_VALUES: vesc.askValues(); break;
+    case OP_ALIVE: vesc.pingAmAlive(); break;
+    case OP_COMMAND:
+    {
+      uint8_t buf[VESC_MT_PAYLOAD+6];
+      memcpy(buf+3, cmd.payload, cmd.len);
+      vesc.sendCommandInplace(buf, cmd.len);
+      break;
+    }
+    case OP_SUBSCRIBE: vesc.addPacketListener((VescPacketListener*)cmd.ptr); break;
+    case OP_UNSUBSCRIBE:
+      vesc.removePacketListener((VescPacketListener*)cmd.ptr);
+      __atomic_store_n(cmd.done, 1, __ATOMIC_RELEASE);
+      break;
+  }
+}
+
+void VescThreadedPort::drain()
+{
+  Cmd cmd;
+  while (queue.pop(&cmd)) execute(cmd);
+}
+
+
+VescIoThread::VescIoThread(uint32_t tick_us)
+  : portCount(0), epfd(-1), wakefd(-1), started(false), running(false), sleeping(0), wheel(tick_us),
+    loopCB(nullptr), loopCtx(nullptr), loops(0), wakeups(0), hangups(0)
+{
+}
+
+VescIoThread::~VescIoThread()
+{
+  stop();
+  closeFds();
+}
+
+void VescIoThread::closeFds()
+{
+  if (epfd >= 0) close(epfd);
+  if (wakefd >= 0) close(wakefd);
+  epfd = wakefd = -1;
+}
+
+int VescIoThread::add(VescThreadedPort *port)
+{
+  if (started) return -EBUSY;
+  if (portCount >= VESC_IO_MAX_PORTS) return -ENOSPC;
+  if (port->uart.handle() < 0) return -EBADF;
+  port->io = this;
+  ports[portCount++] = port;
+  return 0;
+}
+
+int VescIoThread::start()
+{
+  if (started) return -EBUSY;
+  int err = 0;
+  struct epoll_event ev;
+  closeFds();
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) goto fail;
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd < 0) goto fail;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) goto fail;
+  for (uint16_t i = 0; i < portCount; ++i)
+  {
+    ports[i]->events = ev.events = EPOLLIN;
+    ports[i]->hungUp = false;
+    ev.data.ptr = ports[i];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ports[i]->uart.handle(), &ev) < 0) goto fail;
+  }
+
+  __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+  err = pthread_create(&thread, nullptr, threadMain, this);
+  if (err)
+  {
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    closeFds();
+    return -err;
+  }
+  started = true;
+  return 0;
+
+fail:
+  err = -errno;
+  closeFds();
+  return err;
+}
+
+void VescIoThread::stop()
+{
+  if (!started) return;
+  __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+  wake();
+  pthread_join(thread, nullptr);
+  started = false;
+}
+
+void VescIoThread::wake()
+{
+  uint64_t one = 1;
+  if (write(wakefd, &one, sizeof(one)) < 0) { /* counter full, thread wakes up anyway */ }
+}
+
+// EPOLLOUT only while there is something to flush, port is writable nearly always
+void VescIoThread::arm(VescThreadedPort *port)
+{
+  if (port->hungUp) return;
+  uint32_t want = port->uart.txPending() ? EPOLLIN | EPOLLOUT : (uint32_t)EPOLLIN;
+  if (want == port->events) return;
+  struct epoll_event ev;
+  ev.events = want;
+  ev.data.ptr = port;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, port->uart.handle(), &ev) == 0) port->events = want;
+}
+
+void *VescIoThread::threadMain(void *arg)
+{
+  ((VescIoThread*)arg)->run();
+  return nullptr;
+}
+
+void VescIoThread::run()
+{
+  struct epoll_event events[64];
+
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+  {
+    for (uint16_t i = 0; i < portCount; ++i)
+    {
+      VescThreadedPort *p = ports[i];
+      p->drain();
+      p->vesc.flushSetpoints();
+    }
+    wheel.loopstep();
+    if (loopCB) loopCB(this, loopCtx);
+    for (uint16_t i = 0; i < portCount; ++i)
+    {
+      if (ports[i]->hungUp) continue;
+      if (ports[i]->uart.txPending()) ports[i]->uart.flushTx();
+      arm(ports[i]);
+    }
+
+    // tell producers to kick us, then look once more, they may have pushed just before
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    int timeout = (wheel.untilNextTick_us() + 999) / 1000;
+    for (uint16_t i = 0; i < portCount && timeout; ++i)
+      if (!ports[i]->queue.empty()) timeout = 0;
+
+    int n = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), timeout);
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    loops++;
+
+    for (int i = 0; i < n; ++i)
+    {
+      VescThreadedPort *p = (VescThreadedPort*)events[i].data.ptr;
+      if (!p)
+      {
+        uint64_t cnt;
+        if (read(wakefd, &cnt, sizeof(cnt)) > 0) wakeups++;
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+      {
+        // level-triggered, it would come back on every epoll_wait; take what's left and drop the port
+        p->vesc.loopstep();
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->uart.handle(), nullptr);
+        __atomic_store_n(&p->hungUp, true, __ATOMIC_RELEASE);
+        hangups++;
+      }
+      else if (events[i].events & EPOLLIN)
+      {
+        p->vesc.loopstep();
+        p->steppedAt = micros();
+      }
+      else if (events[i].events & EPOLLOUT)
+        p->uart.flushTx();
+    }
+
+    // quiet ports too, once per tick
+    uint32_t now = micros();
+    for (uint16_t i = 0; i < portCount; ++i)
+    {
+      VescThreadedPort *p = ports[i];
+      if (p->hungUp || now - p->steppedAt < wheel.tick_us()) continue;
+      p->vesc.loopstep();
+      p->steppedAt = now;
+    }
+  }
+  // whatever was submitted before stop() still goes out
+  for (uint16_t i = 0; i < portCount; ++i)
+  {
+    ports[i]->drain();
+    if (!ports[i]->hungUp && ports[i]->uart.txPending()) ports[i]->uart.flushTx();
+  }
+}
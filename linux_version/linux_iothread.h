@@ -0,0 +1,168 @@
+#ifndef _LINUX_IOTHREAD_H_
+#define _LINUX_IOTHREAD_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdint>
+#include <pthread.h>
+#include "linux_hwserial.h"
+#include "mpscqueue.h"
+#include "vescuartapi.h"
+#include "vesctimerwheel.h"
+
+// commands waiting for I/O thread, per port, power of two
+#ifndef VESC_MT_QUEUE
+# define VESC_MT_QUEUE 64
+#endif
+// longest payload of sendCommand()
+#define VESC_MT_PAYLOAD 48
+// rx buffer of each port's VescUartApi
+#define VESC_MT_RXBUF 1024
+// ports served by one I/O thread
+#ifndef VESC_IO_MAX_PORTS
+# define VESC_IO_MAX_PORTS 64
+#endif
+
+class VescIoThread;
+
+/* Port shared by several threads
+
+   VescUartApi is not thread-safe, so here only the I/O thread touches it and
+   the uart. Other threads submit commands to lock-free MPSC queue, I/O thread
+   executes them in order. Latest values are published as seqlock snapshot,
+   any thread can read them without locking, and packet listeners can be
+   (un)subscribed from any thread, they are then called from the I/O thread.
+
+   Configure vesc (coalescing, keepalive, ...) before I/O thread starts.
+*/
+class VescThreadedPort {
+  friend class VescIoThread;
+  public:
+    enum Op { OP_SET_CURRENT, OP_SET_CURRENT_BRAKE, OP_SET_DUTY, OP_SET_RPM, OP_ASK_VALUES,
+              OP_ALIVE, OP_COMMAND, OP_SUBSCRIBE, OP_UNSUBSCRIBE };
+
+  private:
+    struct Cmd {
+      uint8_t op;
+      uint8_t len;
+      int32_t value;
+      void *ptr;          // listener of (un)subscribe
+      uint32_t *done;     // set when unsubscribe was executed
+      uint8_t payload[VESC_MT_PAYLOAD];
+    };
+
+    HardwareSerial uart;
+    MpscQueue<Cmd, VESC_MT_QUEUE> queue;
+    VescPacketListener valuesListener;
+    uint32_t valuesSeq;   // odd while snapshot is being written
+    ValuesData snapshot;
+    VescIoThread *io;
+    uint32_t events;      // epoll events armed for uart, EPOLLOUT only while tx queue is not empty
+    uint32_t steppedAt;   // last vesc.loopstep() in I/O thread
+    bool hungUp;          // uart reported EPOLLHUP/EPOLLERR, removed from epoll
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    bool submit(const Cmd &cmd);
+    bool submitValue(uint8_t op, int32_t value);
+    void execute(const Cmd &cmd);
+    void drain();
+
+  public:
+    // only for setup before I/O thread starts, and for the I/O thread itself
+    VescUartApiStatic<VESC_MT_RXBUF> vesc;
+
+    uint32_t submitted;
+    uint32_t queueFull;   // commands refused, queue was full
+
+    VescThreadedPort(const char *path);
+    ~VescThreadedPort() { vesc.removePacketListener(&valuesListener); }
+
+    int begin(int baud) { return uart.begin(baud); }
+    HardwareSerial *serial() { return &uart; }
+    // false once I/O thread dropped the uart after hangup or error
+    bool alive() const { return !__atomic_load_n(&hungUp, __ATOMIC_ACQUIRE); }
+
+    // any thread, false if command queue is full
+    bool setCurrent(int32_t miliamps) { return submitValue(OP_SET_CURRENT, miliamps); }
+    bool setCurrentBrake(int32_t miliamps) { return submitValue(OP_SET_CURRENT_BRAKE, miliamps); }
+    bool setDuty(int32_t duty) { return submitValue(OP_SET_DUTY, duty); }
+    bool setRPM(int32_t rpm) { return submitValue(OP_SET_RPM, rpm); }
+    bool askValues() { return submitValue(OP_ASK_VALUES, 0); }
+    bool pingAmAlive() { return submitValue(OP_ALIVE, 0); }
+    // payload starts with COMM id, it's copied
+    bool sendCommand(const uint8_t *payload, uint8_t len);
+    // listener is called from I/O thread for every packet
+    bool subscribe(VescPacketListener *listener);
+    // waits until I/O thread removed it, listener can be freed after that
+    bool unsubscribe(VescPacketListener *listener);
+
+    // latest COMM_GET_VALUES(_SELECTIVE), false if there was none yet; seq grows with every update
+    bool values(ValuesData *out, uint32_t *seq = nullptr) const;
+};
+
+/* I/O thread for a shard of ports
+
+   One epoll over all ports and an eventfd producers kick when the thread
+   sleeps. Port is stepped when it's readable, its tx queue is flushed when it
+   becomes writable, and every tick each port is stepped anyway, so coalesced
+   setpoints and scheduled frames of quiet ports go out too. Timer wheel runs in
+   the same thread, so keepalives of these ports belong to it:
+   VescKeepalive ka(&io.wheel, &port.vesc). Port whose uart hangs up or fails
+   is removed from epoll and not stepped anymore, see alive().
+*/
+class VescIoThread {
+  friend class VescThreadedPort;
+  private:
+    VescThreadedPort *ports[VESC_IO_MAX_PORTS];
+    uint16_t portCount;
+    int epfd;
+    int wakefd;
+    pthread_t thread;
+    bool started;
+    bool running;         // __atomic_*, cleared by stop()
+    uint32_t sleeping;    // I/O thread is (about to be) in epoll_wait, producers have to wake it
+
+    static void *threadMain(void *arg);
+    void run();
+    void wake();
+    void arm(VescThreadedPort *port);
+    void closeFds();
+
+  public:
+    VescTimerWheel wheel;
+    // called from I/O thread in every loop, e.g. for pollers
+    void(*loopCB)(VescIoThread *io, void *ctx);
+    void *loopCtx;
+
+    // stats
+    uint64_t loops;
+    uint64_t wakeups;     // eventfd kicks from producers
+    uint32_t hangups;     // ports dropped after EPOLLHUP/EPOLLERR
+
+    VescIoThread(uint32_t tick_us = 1000);
+    ~VescIoThread();
+
+    // before start(), port has to be opened with begin() already
+    int add(VescThreadedPort *port);
+    uint16_t size() const { return portCount; }
+    VescThreadedPort *port(uint16_t i) { return ports[i]; }
+    int start();
+    void stop();
+};
+
+#endif /* _LINUX_IOTHREAD_H_ */
@@ -0,0 +1,157 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <sched.h>
+#include <sys/mman.h>
+#include "linux_rtloop.h"
+#include "datatypes.h"
+
+VescControlLoop::VescControlLoop(VescUartApi *vesc, uint32_t period_us)
+  : vesc(vesc), period_ns((uint64_t)period_us * 1000), running(false), gotValues(false), tickCB(nullptr),
+    fifoPriority(0), cpu(-1), lockMemory(false), userdata(nullptr), setupFailed(0)
+{
+  listener.cb = onPacket;
+  listener.ctx = this;
+  listener.next = nullptr;
+  vesc->addPacketListener(&listener);
+  resetStats();
+}
+
+void VescControlLoop::onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t)
+{
+  if (packet[0] == COMM_GET_VALUES || packet[0] == COMM_GET_VALUES_SELECTIVE)
+    ((VescControlLoop*)ctx)->gotValues = true;
+}
+
+void VescControlLoop::resetStats()
+{
+  ticks = overruns = sumJitter_ns = 0;
+  minJitter_ns = UINT32_MAX;
+  maxJitter_ns = 0;
+  for (uint32_t i = 0; i <= VESC_RT_HIST; ++i) hist[i] = 0;
+}
+
+int VescControlLoop::setup()
+{
+  int ret = 0;
+  setupFailed = 0;
+
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    {
+      ret = -errno;
+      setupFailed |= RT_PIN;
+    }
+  }
+
+  if (fifoPriority > 0)
+  {
+    struct sched_param param;
+    param.sched_priority = fifoPriority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+    {
+      ret = -errno;
+      setupFailed |= RT_FIFO;
+    }
+  }
+
+  if (lockMemory)
+  {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+      ret = -errno;
+      setupFailed |= RT_MLOCK;
+    }
+  }
+
+  return ret;
+}
+
+void VescControlLoop::record(uint32_t jitter_ns)
+{
+  ticks++;
+  sumJitter_ns += jitter_ns;
+  if (jitter_ns < minJitter_ns) minJitter_ns = jitter_ns;
+  if (jitter_ns > maxJitter_ns) maxJitter_ns = jitter_ns;
+  uint32_t us = jitter_ns / 1000;
+  hist[us < VESC_RT_HIST ? us : VESC_RT_HIST]++;
+}
+
+static inline int64_t ts_ns(const struct timespec *t)
+{
+  return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+static inline void ts_add(struct timespec *t, int64_t ns)
+{
+  ns += t->tv_nsec;
+  t->tv_sec += ns / 1000000000;
+  t->tv_nsec = ns % 1000000000;
+}
+
+int VescControlLoop::run(uint64_t count)
+{
+  struct timespec next, now;
+
+  __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (uint64_t n = 0; __atomic_load_n(&running, __ATOMIC_ACQUIRE) && (!count || n < count); ++n)
+  {
+    ts_add(&next, period_ns);
+    int err;
+    while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr)) == EINTR)
+      ;
+    if (err) return -err;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t late = ts_ns(&now) - ts_ns(&next);
+    record(late > 0 ? (late < UINT32_MAX ? late : UINT32_MAX) : 0);
+
+    gotValues = false;
+    vesc->loopstep();
+    if (tickCB) tickCB(this, &vesc->values_data, gotValues);
+
+    // tick took longer than period, skip missed deadlines
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t behind = ts_ns(&now) - ts_ns(&next);
+    if (behind >= (int64_t)period_ns)
+    {
+      overruns++;
+      ts_add(&next, (behind / (int64_t)period_ns) * (int64_t)period_ns);
+    }
+  }
+  __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+  return 0;
+}
+
+uint32_t VescControlLoop::jitterPercentile_us(uint8_t pct) const
+{
+  if (!ticks) return 0;
+  uint64_t want = (ticks * pct + 99) / 100;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i <= VESC_RT_HIST; ++i)
+  {
+    seen += hist[i];
+    if (seen >= want) return i;
+  }
+  return VESC_RT_HIST;
+}
@@ -0,0 +1,91 @@
+#ifndef _LINUX_RTLOOP_H_
+#define _LINUX_RTLOOP_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdint>
+#include <time.h>
+#include "vescuartapi.h"
+
+// jitter histogram, 1 us per bucket, last bucket takes everything longer
+#ifndef VESC_RT_HIST
+# define VESC_RT_HIST 1000
+#endif
+
+/* Fixed rate control loop for Linux
+
+   Wakes up on absolute deadlines with clock_nanosleep(TIMER_ABSTIME), so period
+   does not drift by however long the tick took, like with usleep(). Optionally
+   runs as SCHED_FIFO, pinned to one CPU and with memory locked, which is what
+   keeps jitter bounded at 1-2 kHz on stock kernel (needs CAP_SYS_NICE /
+   CAP_IPC_LOCK or root, failed options are in setupFailed and loop runs anyway).
+
+   Every tick calls vesc->loopstep() first and then tick callback with current
+   values, fresh is true when new COMM_GET_VALUES(_SELECTIVE) came since last tick.
+   Jitter is how late the loop woke up. Tick which ends after next deadline is
+   an overrun, missed periods are skipped, not caught up.
+*/
+class VescControlLoop {
+  private:
+    VescUartApi *vesc;
+    VescPacketListener listener;
+    uint64_t period_ns;
+    bool running;       // __atomic, stop() may come from another thread
+    bool gotValues;
+    void(*tickCB)(VescControlLoop *, const ValuesData *values, bool fresh);
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    void record(uint32_t jitter_ns);
+
+  public:
+    int fifoPriority;   // SCHED_FIFO priority 1..99, 0 = keep normal scheduling
+    int cpu;            // pin to this CPU, -1 = don't pin
+    bool lockMemory;    // mlockall() before loop starts
+    void *userdata;     // for tick callback
+
+    // options setup() could not apply
+    enum { RT_PIN = 1, RT_FIFO = 2, RT_MLOCK = 4 };
+    uint8_t setupFailed;
+
+    // stats
+    uint64_t ticks;
+    uint64_t overruns;
+    uint32_t minJitter_ns;
+    uint32_t maxJitter_ns;
+    uint64_t sumJitter_ns;
+    uint32_t hist[VESC_RT_HIST+1];
+
+    VescControlLoop(VescUartApi *vesc, uint32_t period_us);
+    ~VescControlLoop() { vesc->removePacketListener(&listener); }
+
+    void setTickCB(void(*cb)(VescControlLoop *, const ValuesData *values, bool fresh)) { tickCB = cb; }
+    // applies scheduling options of calling thread, returns 0 or -errno of the last failure, see setupFailed
+    int setup();
+    // runs ticks periods (0 = until stop()), in calling thread
+    int run(uint64_t ticks = 0);
+    // can be called from tick callback or another thread
+    void stop() { __atomic_store_n(&running, false, __ATOMIC_RELEASE); }
+    void resetStats();
+
+    uint32_t period_us() const { return period_ns / 1000; }
+    uint32_t meanJitter_ns() const { return ticks ? sumJitter_ns / ticks : 0; }
+    // jitter under which pct % of ticks woke up, us resolution
+    uint32_t jitterPercentile_us(uint8_t pct) const;
+};
+
+#endif /* _LINUX_RTLOOP_H_ */
@@ -0,0 +1,305 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include "linux_valuesbatch.h"
+
+#if !defined(VESC_BATCH_NO_SIMD)
+# if defined(__x86_64__) || defined(__i386__)
+#  define BATCH_X86
+#  include <immintrin.h>
+# elif defined(__aarch64__) && defined(__ARM_NEON)
+#  define BATCH_NEON
+#  include <arm_neon.h>
+# endif
+#endif
+
+/* Kernels decode one column, p points to the field in the first payload.
+   They return how many rows they did, the rest is left to the scalar loop.
+   Vector ones read 4 bytes at p, also for 2 byte fields.
+*/
+struct Kernels {
+  const char *name;
+  uint32_t (*f16)(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst);
+  uint32_t (*f32)(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst);
+  uint32_t (*i32)(const uint8_t *p, uint32_t stride, uint32_t count, int32_t *dst);
+};
+
+static inline int32_t getBE32(const uint8_t *p)
+{
+  return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static uint32_t scalarF16(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  for (uint32_t i = 0; i < count; ++i, p += stride)
+    dst[i] = (float)(int16_t)(((uint16_t)p[0] << 8) | p[1]) / scale;
+  return count;
+}
+
+static uint32_t scalarF32(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  for (uint32_t i = 0; i < count; ++i, p += stride)
+    dst[i] = (float)getBE32(p) / scale;
+  return count;
+}
+
+static uint32_t scalarI32(const uint8_t *p, uint32_t stride, uint32_t count, int32_t *dst)
+{
+  for (uint32_t i = 0; i < count; ++i, p += stride)
+    dst[i] = getBE32(p);
+  return count;
+}
+
+static const Kernels scalarKernels = { "scalar", scalarF16, scalarF32, scalarI32 };
+
+#if defined(BATCH_X86)
+/* AVX2 gathers 8 rows at once, SSE4.1 loads 4 of them one by one. pshufb swaps
+   bytes, int16 is then in the upper half and arithmetic shift sign extends it.
+   Division and not multiplication by 1/scale, so rounding is the same as in C++.
+*/
+__attribute__((target("avx2")))
+static inline __m256i avx2Load(const uint8_t *p, __m256i lanes)
+{
+  const __m256i swap = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                        3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+  return _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)p, lanes, 1), swap);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2Lanes(uint32_t stride)
+{
+  return _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2F16(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const __m256i lanes = avx2Lanes(stride);
+  const __m256 s = _mm256_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8, p += 8 * stride)
+  {
+    __m256i v = _mm256_srai_epi32(avx2Load(p, lanes), 16);
+    _mm256_storeu_ps(dst + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), s));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2F32(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const __m256i lanes = avx2Lanes(stride);
+  const __m256 s = _mm256_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8, p += 8 * stride)
+    _mm256_storeu_ps(dst + i, _mm256_div_ps(_mm256_cvtepi32_ps(avx2Load(p, lanes)), s));
+  return i;
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2I32(const uint8_t *p, uint32_t stride, uint32_t count, int32_t *dst)
+{
+  const __m256i lanes = avx2Lanes(stride);
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8, p += 8 * stride)
+    _mm256_storeu_si256((__m256i*)(dst + i), avx2Load(p, lanes));
+  return i;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i sseLoad(const uint8_t *p, uint32_t stride)
+{
+  const __m128i swap = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+  int32_t r[4];
+  for (int l = 0; l < 4; ++l) memcpy(&r[l], p + l * stride, 4);
+  return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)r), swap);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t sseF16(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const __m128 s = _mm_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+  {
+    __m128i v = _mm_srai_epi32(sseLoad(p, stride), 16);
+    _mm_storeu_ps(dst + i, _mm_div_ps(_mm_cvtepi32_ps(v), s));
+  }
+  return i;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t sseF32(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const __m128 s = _mm_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+    _mm_storeu_ps(dst + i, _mm_div_ps(_mm_cvtepi32_ps(sseLoad(p, stride)), s));
+  return i;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t sseI32(const uint8_t *p, uint32_t stride, uint32_t count, int32_t *dst)
+{
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+    _mm_storeu_si128((__m128i*)(dst + i), sseLoad(p, stride));
+  return i;
+}
+
+static const Kernels avx2Kernels = { "avx2", avx2F16, avx2F32, avx2I32 };
+static const Kernels sseKernels = { "sse4.1", sseF16, sseF32, sseI32 };
+#endif
+
+#if defined(BATCH_NEON)
+static inline int32x4_t neonLoad(const uint8_t *p, uint32_t stride)
+{
+  uint32_t r[4];
+  for (int l = 0; l < 4; ++l) memcpy(&r[l], p + l * stride, 4);
+  return vreinterpretq_s32_u8(vrev32q_u8(vreinterpretq_u8_u32(vld1q_u32(r))));
+}
+
+static uint32_t neonF16(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const float32x4_t s = vdupq_n_f32(scale);
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+    vst1q_f32(dst + i, vdivq_f32(vcvtq_f32_s32(vshrq_n_s32(neonLoad(p, stride), 16)), s));
+  return i;
+}
+
+static uint32_t neonF32(const uint8_t *p, uint32_t stride, uint32_t count, float scale, float *dst)
+{
+  const float32x4_t s = vdupq_n_f32(scale);
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+    vst1q_f32(dst + i, vdivq_f32(vcvtq_f32_s32(neonLoad(p, stride)), s));
+  return i;
+}
+
+static uint32_t neonI32(const uint8_t *p, uint32_t stride, uint32_t count, int32_t *dst)
+{
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4, p += 4 * stride)
+    vst1q_s32(dst + i, neonLoad(p, stride));
+  return i;
+}
+
+static const Kernels neonKernels = { "neon", neonF16, neonF32, neonI32 };
+#endif
+
+static const Kernels *kernels()
+{
+  static const Kernels *k;
+  if (!k)
+  {
+#if defined(BATCH_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) k = &avx2Kernels;
+    else if (__builtin_cpu_supports("sse4.1")) k = &sseKernels;
+    else k = &scalarKernels;
+#elif defined(BATCH_NEON)
+    k = &neonKernels;
+#else
+    k = &scalarKernels;
+#endif
+  }
+  return k;
+}
+
+const char *VescValuesBatch::isa()
+{
+  return kernels()->name;
+}
+
+VescValuesBatch::VescValuesBatch(uint32_t mask, bool selective)
+{
+  // command byte, selective reply repeats the mask
+  uint16_t off = selective ? 5 : 1;
+  for (uint8_t f = 0; f < VALUE_FIELD_COUNT; ++f)
+  {
+    if (mask & ((uint32_t)1 << f))
+    {
+      offset[f] = off;
+      off += vescValueFieldBytes[f];
+    }
+    else offset[f] = -1;
+  }
+  bytes = off;
+}
+
+// rows whose 4 byte vector load stays inside of payloads, last one may read past the end
+static inline uint32_t safeRows(int16_t off, uint32_t stride, uint32_t count)
+{
+  return (uint32_t)off + 4 <= stride || !count ? count : count - 1;
+}
+
+static void columnF16(const Kernels *k, const uint8_t *payloads, uint32_t stride, uint32_t count, int16_t off, float scale, float *dst)
+{
+  if (!dst || off < 0) return;
+  const uint8_t *p = payloads + off;
+  uint32_t done = k->f16(p, stride, safeRows(off, stride, count), scale, dst);
+  scalarF16(p + (size_t)done * stride, stride, count - done, scale, dst + done);
+}
+
+static void columnF32(const Kernels *k, const uint8_t *payloads, uint32_t stride, uint32_t count, int16_t off, float scale, float *dst)
+{
+  if (!dst || off < 0) return;
+  const uint8_t *p = payloads + off;
+  uint32_t done = k->f32(p, stride, safeRows(off, stride, count), scale, dst);
+  scalarF32(p + (size_t)done * stride, stride, count - done, scale, dst + done);
+}
+
+static void columnI32(const Kernels *k, const uint8_t *payloads, uint32_t stride, uint32_t count, int16_t off, int32_t *dst)
+{
+  if (!dst || off < 0) return;
+  const uint8_t *p = payloads + off;
+  uint32_t done = k->i32(p, stride, safeRows(off, stride, count), dst);
+  scalarI32(p + (size_t)done * stride, stride, count - done, dst + done);
+}
+
+static void columnI8(const uint8_t *payloads, uint32_t stride, uint32_t count, int16_t off, int8_t *dst)
+{
+  if (!dst || off < 0) return;
+  const uint8_t *p = payloads + off;
+  for (uint32_t i = 0; i < count; ++i, p += stride)
+    dst[i] = (int8_t)*p;
+}
+
+void VescValuesBatch::decode(const uint8_t *payloads, uint32_t stride, uint32_t count, const ValuesColumns *out) const
+{
+  const Kernels *k = kernels();
+  // scales as in rcvd_GET_VALUES()
+  columnF16(k, payloads, stride, count, offset[0], 10.0f, out->temp_fet);
+  columnF16(k, payloads, stride, count, offset[1], 10.0f, out->temp_motor);
+  columnF32(k, payloads, stride, count, offset[2], 100.0f, out->avg_motor_current);
+  columnF32(k, payloads, stride, count, offset[3], 100.0f, out->avg_input_current);
+  columnF32(k, payloads, stride, count, offset[4], 100.0f, out->avg_id);
+  columnF32(k, payloads, stride, count, offset[5], 100.0f, out->avg_iq);
+  columnF16(k, payloads, stride, count, offset[6], 1000.0f, out->duty_cycle_now);
+  columnF32(k, payloads, stride, count, offset[7], 1.0f, out->rpm);
+  columnF16(k, payloads, stride, count, offset[8], 10.0f, out->input_voltage);
+  columnF32(k, payloads, stride, count, offset[9], 10000.0f, out->amp_hours);
+  columnF32(k, payloads, stride, count, offset[10], 10000.0f, out->amp_hours_charged);
+  columnF32(k, payloads, stride, count, offset[11], 10000.0f, out->watt_hours);
+  columnF32(k, payloads, stride, count, offset[12], 10000.0f, out->watt_hours_charged);
+  columnI32(k, payloads, stride, count, offset[13], out->tachometer_value);
+  columnI32(k, payloads, stride, count, offset[14], out->tachometer_abs_value);
+  columnI8(payloads, stride, count, offset[15], out->fault);
+  columnF32(k, payloads, stride, count, offset[16], 1000000.0f, out->pid_pos);
+  columnI8(payloads, stride, count, offset[17], out->controller_id);
+}
@@ -0,0 +1,73 @@
+#ifndef _LINUX_VALUESBATCH_H_
+#define _LINUX_VALUESBATCH_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdint>
+#include "vescuartapi.h"
+
+/* Output columns of VescValuesBatch, value of payload n goes to column[n].
+   Same fields and scaling as ValuesData, plus the ones rcvd_GET_VALUES() skips.
+   nullptr column is not decoded, field missing in layout leaves column untouched.
+*/
+struct ValuesColumns {
+  float *temp_fet;
+  float *temp_motor;
+  float *avg_motor_current;
+  float *avg_input_current;
+  float *avg_id;
+  float *avg_iq;
+  float *duty_cycle_now;
+  float *rpm;
+  float *input_voltage;
+  float *amp_hours;
+  float *amp_hours_charged;
+  float *watt_hours;
+  float *watt_hours_charged;
+  int32_t *tachometer_value;
+  int32_t *tachometer_abs_value;
+  int8_t *fault;
+  float *pid_pos;
+  int8_t *controller_id;
+};
+
+/* Batch decoder of COMM_GET_VALUES(_SELECTIVE) payloads, e.g. from capture files.
+
+   All payloads have the same layout (same mask) and lie stride bytes apart, payload
+   starts with the command byte like in packet listener. Column by column, values are
+   byte-swapped, converted and scaled by AVX2 or SSE4.1 (picked at run time) or NEON,
+   other CPUs and -DVESC_BATCH_NO_SIMD use plain C++. Results are bit for bit the
+   same as from rcvd_GET_VALUES(). Payloads are not checked, stride has to be at
+   least payloadBytes().
+
+   Full COMM_GET_VALUES of older firmware has fewer fields, give its mask then,
+   e.g. (1 << 15) - 1 for one ending with fault.
+*/
+class VescValuesBatch {
+  private:
+    int16_t offset[VALUE_FIELD_COUNT];  // field offset in payload, -1 if not in layout
+    uint16_t bytes;
+
+  public:
+    VescValuesBatch(uint32_t mask = 0xffffffff, bool selective = false);
+    uint16_t payloadBytes() const { return bytes; }
+    void decode(const uint8_t *payloads, uint32_t stride, uint32_t count, const ValuesColumns *out) const;
+    // instruction set used by decode(): "avx2", "sse4.1", "neon" or "scalar"
+    static const char *isa();
+};
+
+#endif // _LINUX_VALUESBATCH_H_
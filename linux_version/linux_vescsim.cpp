@@ -0,0 +1,397 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "linux_hwserial.h"
+#include "linux_vescsim.h"
+#include "buffer.h"
+#include "crc.h"
+#include "datatypes.h"
+
+// motor model: erpm per second per amp, friction per second, erpm per volt at full duty
+#define SIM_ACCEL 2000.0f
+#define SIM_DRAG 0.5f
+#define SIM_ERPM_PER_V 1400.0f
+#define SIM_MAX_CURRENT 60.0f
+
+VescSim::VescSim(uint32_t seed)
+  : master(-1), rxlen(0), pendHead(0), pendCount(0), frontSent(0), lineFreeAt(0), rng(seed * 0x9e3779b9u ^ 0x5bd1e995u),
+    mode(MODE_RELEASE), target(0), erpm(0), motorCurrent(0), inputCurrent(0), tempFet(25), tempMotor(25),
+    ampHours(0), ampHoursCharged(0), wattHours(0), wattHoursCharged(0), tacho(0), tachoAbs(0),
+    lastCmdAt(0), lastModelAt(micros()), latency_us(0), baud(0), errorRate(0), timeout_us(1000000),
+    fw{3, 40}, controllerId(0), voltage(36.0f), packetsIn(0), packetsOut(0), badIn(0), corrupted(0), overflows(0)
+{
+  slavePath[0] = 0;
+  // xorshift gives tiny numbers for a while after small seeds, they'd all be errors
+  if (!rng) rng = 1;
+  for (uint8_t i = 0; i < 16; ++i) nextRandom();
+}
+
+VescSim::~VescSim()
+{
+  if (master >= 0) close(master);
+}
+
+int VescSim::open(const char *link)
+{
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (master < 0) return -errno;
+  if (grantpt(master) < 0 || unlockpt(master) < 0 || ptsname_r(master, slavePath, sizeof(slavePath)))
+    return -errno;
+
+  // raw from the start, client's begin() sets its own termios anyway
+  int slave = ::open(slavePath, O_RDWR | O_NOCTTY);
+  if (slave >= 0)
+  {
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    close(slave);
+  }
+
+  if (link)
+  {
+    unlink(link);
+    if (symlink(slavePath, link) < 0) return -errno;
+  }
+  return 0;
+}
+
+uint32_t VescSim::nextRandom()
+{
+  // xorshift32, reproducible with the same seed
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+void VescSim::step()
+{
+  uint32_t now = micros();
+  for (;;)
+  {
+    ssize_t n = read(master, rx+rxlen, sizeof(rx)-rxlen);
+    if (n <= 0) break;   // EAGAIN, or EIO while no client has the slave open
+    rxlen += n;
+    parse(now);
+    if (n < (ssize_t)(sizeof(rx)-rxlen)) break;
+  }
+  updateModel(now);
+  pump(now);
+}
+
+void VescSim::parse(uint32_t now)
+{
+  uint16_t start = 0;
+  while (rxlen - start >= 6)
+  {
+    const uint8_t *p = rx + start;
+    uint16_t hdr, len;
+    if (p[0] == 2) { hdr = 2; len = p[1]; }
+    else if (p[0] == 3) { hdr = 3; len = (p[1] << 8) | p[2]; }
+    else { start++; continue; }
+
+    if (hdr + len + 3 > (int)sizeof(rx) || !len) { start++; continue; }
+    if (rxlen - start < hdr + len + 3) break;
+
+    const uint8_t *payload = p + hdr;
+    uint16_t crc = (payload[len] << 8) | payload[len+1];
+    if (payload[len+2] != 3 || crc != crc16((uint8_t*)payload, len))
+    {
+      badIn++;
+      start++;
+      continue;
+    }
+    packetsIn++;
+    process(payload, len, now);
+    start += hdr + len + 3;
+  }
+  if (start == rxlen) rxlen = 0;
+  else if (start)
+  {
+    memmove(rx, rx+start, rxlen-start);
+    rxlen -= start;
+  }
+  // full of garbage without any packet start
+  if (rxlen == sizeof(rx)) rxlen = 0;
+}
+
+void VescSim::process(const uint8_t *payload, uint16_t len, uint32_t now)
+{
+  uint8_t out[600];
+  int32_t index = 0;
+  int32_t i = 1;
+  uint8_t cmd = payload[0];
+
+  switch (cmd)
+  {
+    case COMM_FW_VERSION:
+    {
+      static const char hw[] = "SIM";
+      out[index++] = COMM_FW_VERSION;
+      out[index++] = fw[0];
+      out[index++] = fw[1];
+      memcpy(out+index, hw, sizeof(hw));
+      index += sizeof(hw);
+      for (uint8_t u = 0; u < 12; ++u) out[index++] = controllerId ^ u;  // uuid
+      out[index++] = 0;   // paired
+      out[index++] = 0;   // test version
+      reply(out, index, now);
+      break;
+    }
+
+    case COMM_GET_VALUES:
+      out[index++] = COMM_GET_VALUES;
+      index += encodeValues(out+index, 0xffffffff);
+      reply(out, index, now);
+      break;
+
+    case COMM_GET_VALUES_SELECTIVE:
+    {
+      if (len < 5) break;
+      uint32_t mask = buffer_get_uint32(payload, &i);
+      out[index++] = COMM_GET_VALUES_SELECTIVE;
+      buffer_append_uint32(out, mask, &index);
+      index += encodeValues(out+index, mask);
+      reply(out, index, now);
+      break;
+    }
+
+    case COMM_GET_MCCONF:
+    case COMM_GET_MCCONF_DEFAULT:
+    case COMM_GET_APPCONF:
+    case COMM_GET_APPCONF_DEFAULT:
+      out[index++] = cmd;
+      index += encodeConf(out+index, cmd);
+      reply(out, index, now);
+      break;
+
+    case COMM_PING_CAN:
+      // no CAN nodes
+      out[index++] = COMM_PING_CAN;
+      reply(out, index, now);
+      break;
+
+    case COMM_TERMINAL_CMD:
+    case COMM_TERMINAL_CMD_SYNC:
+    {
+      static const char prefix[] = "sim: ";
+      uint16_t n = len - 1 < 200 ? len - 1 : 200;
+      out[index++] = COMM_PRINT;
+      memcpy(out+index, prefix, sizeof(prefix)-1);
+      index += sizeof(prefix)-1;
+      memcpy(out+index, payload+1, n);
+      index += n;
+      reply(out, index, now);
+      break;
+    }
+
+    case COMM_ALIVE:
+      lastCmdAt = now;
+      break;
+
+    case COMM_SET_CURRENT:
+    case COMM_SET_CURRENT_BRAKE:
+    case COMM_SET_DUTY:
+    case COMM_SET_RPM:
+    {
+      if (len < 5) break;
+      int32_t v = buffer_get_int32(payload, &i);
+      lastCmdAt = now;
+      if (cmd == COMM_SET_CURRENT) { mode = MODE_CURRENT; target = v / 1000.0f; }
+      else if (cmd == COMM_SET_CURRENT_BRAKE) { mode = MODE_BRAKE; target = v / 1000.0f; }
+      else if (cmd == COMM_SET_DUTY) { mode = MODE_DUTY; target = v / 100000.0f; }
+      else { mode = MODE_RPM; target = v; }
+      break;
+    }
+
+    default:
+      // everything else is accepted silently
+      break;
+  }
+}
+
+int32_t VescSim::encodeValues(uint8_t *dst, uint32_t mask)
+{
+  int32_t index = 0;
+  float duty = erpm / (voltage * SIM_ERPM_PER_V);
+  // same order as COMM_GET_VALUES in firmware's commands.c
+  if (mask & ((uint32_t)1 << 0)) buffer_append_float16(dst, tempFet, 10.0, &index);
+  if (mask & ((uint32_t)1 << 1)) buffer_append_float16(dst, tempMotor, 10.0, &index);
+  if (mask & ((uint32_t)1 << 2)) buffer_append_float32(dst, motorCurrent, 100.0, &index);
+  if (mask & ((uint32_t)1 << 3)) buffer_append_float32(dst, inputCurrent, 100.0, &index);
+  if (mask & ((uint32_t)1 << 4)) buffer_append_float32(dst, 0, 100.0, &index);             // id
+  if (mask & ((uint32_t)1 << 5)) buffer_append_float32(dst, motorCurrent, 100.0, &index);  // iq
+  if (mask & ((uint32_t)1 << 6)) buffer_append_float16(dst, duty, 1000.0, &index);
+  if (mask & ((uint32_t)1 << 7)) buffer_append_float32(dst, erpm, 1.0, &index);
+  if (mask & ((uint32_t)1 << 8)) buffer_append_float16(dst, voltage - 0.05f * inputCurrent, 10.0, &index);
+  if (mask & ((uint32_t)1 << 9)) buffer_append_float32(dst, ampHours, 10000.0, &index);
+  if (mask & ((uint32_t)1 << 10)) buffer_append_float32(dst, ampHoursCharged, 10000.0, &index);
+  if (mask & ((uint32_t)1 << 11)) buffer_append_float32(dst, wattHours, 10000.0, &index);
+  if (mask & ((uint32_t)1 << 12)) buffer_append_float32(dst, wattHoursCharged, 10000.0, &index);
+  if (mask & ((uint32_t)1 << 13)) buffer_append_int32(dst, (int32_t)tacho, &index);
+  if (mask & ((uint32_t)1 << 14)) buffer_append_int32(dst, (int32_t)tachoAbs, &index);
+  if (mask & ((uint32_t)1 << 15)) dst[index++] = 0;   // fault
+  if (mask & ((uint32_t)1 << 16)) buffer_append_float32(dst, fmodf(tachoAbs * 60.0f, 360.0f), 1000000.0, &index);
+  if (mask & ((uint32_t)1 << 17)) dst[index++] = controllerId;
+  if (mask & ((uint32_t)1 << 18))
+    for (uint8_t n = 0; n < 3; ++n) buffer_append_float16(dst, tempFet, 10.0, &index);
+  return index;
+}
+
+int32_t VescSim::encodeConf(uint8_t *dst, uint8_t cmd)
+{
+  // real configuration layout depends on firmware version, this one has realistic size
+  // (long frame for mcconf) and signature, then plausible limits repeated
+  int32_t index = 0;
+  bool mc = cmd == COMM_GET_MCCONF || cmd == COMM_GET_MCCONF_DEFAULT;
+  buffer_append_uint32(dst, mc ? 0x9a7e31f3 : 0x2b5a1e6c, &index);
+  uint16_t fields = mc ? 110 : 45;
+  for (uint16_t f = 0; f < fields; ++f)
+  {
+    static const float limits[] = { 60.0f, -60.0f, 99.0f, -99.0f, 60000.0f, -60000.0f, 8.0f, 57.0f, 0.95f, 0.005f };
+    buffer_append_float32(dst, limits[f % 10], 1000.0, &index);
+  }
+  dst[index++] = controllerId;
+  return index;
+}
+
+void VescSim::updateModel(uint32_t now)
+{
+  float dt = (now - lastModelAt) / 1000000.0f;
+  lastModelAt = now;
+  if (dt <= 0) return;
+  if (dt > 0.1f) dt = 0.1f;
+
+  if (mode != MODE_RELEASE && now - lastCmdAt > timeout_us) mode = MODE_RELEASE;
+
+  float maxErpm = voltage * SIM_ERPM_PER_V;
+  float current = 0;
+  switch (mode)
+  {
+    case MODE_CURRENT: current = target; break;
+    case MODE_BRAKE:
+      current = fabsf(erpm) < 50 ? 0 : (erpm > 0 ? -fabsf(target) : fabsf(target));
+      break;
+    case MODE_DUTY: current = (target * maxErpm - erpm) * 0.01f; break;
+    case MODE_RPM: current = (target - erpm) * 0.01f; break;
+    default: break;
+  }
+  if (current > SIM_MAX_CURRENT) current = SIM_MAX_CURRENT;
+  if (current < -SIM_MAX_CURRENT) current = -SIM_MAX_CURRENT;
+
+  erpm += (current * SIM_ACCEL - erpm * SIM_DRAG) * dt;
+  if (erpm > maxErpm) erpm = maxErpm;
+  if (erpm < -maxErpm) erpm = -maxErpm;
+
+  motorCurrent = current;
+  inputCurrent = current * fabsf(erpm / maxErpm);
+  float ah = fabsf(current) * dt / 3600.0f;
+  float wh = fabsf(inputCurrent) * voltage * dt / 3600.0f;
+  // current against rotation is regenerative braking
+  if (current * erpm < 0) { ampHoursCharged += ah; wattHoursCharged += wh; }
+  else { ampHours += ah; wattHours += wh; }
+  tacho += erpm / 60.0f * 6.0f * dt;
+  tachoAbs += fabsf(erpm) / 60.0f * 6.0f * dt;
+  tempFet += (25.0f + 0.02f * current * current - tempFet) * dt / 30.0f;
+  tempMotor += (25.0f + 0.03f * current * current - tempMotor) * dt / 60.0f;
+}
+
+void VescSim::reply(const uint8_t *payload, uint16_t len, uint32_t now)
+{
+  uint8_t hdr[3];
+  uint8_t tail[3];
+  uint16_t hdrlen;
+  if (len < 256) { hdr[0] = 2; hdr[1] = len; hdrlen = 2; }
+  else { hdr[0] = 3; hdr[1] = len >> 8; hdr[2] = len & 0xff; hdrlen = 3; }
+  uint16_t crc = crc16((uint8_t*)payload, len);
+  tail[0] = crc >> 8;
+  tail[1] = crc & 0xff;
+  tail[2] = 3;
+  uint16_t framelen = hdrlen + len + 3;
+
+  if (pendCount == VESC_SIM_PENDING || txbuf.freeSpace() < framelen)
+  {
+    overflows++;
+    return;
+  }
+  txbuf.store(hdr, hdrlen);
+  txbuf.store(payload, len);
+  txbuf.store(tail, 3);
+
+  // whole frame is released when its last byte would arrive
+  uint32_t at = now + latency_us;
+  if (baud > 0)
+  {
+    if ((int32_t)(lineFreeAt - at) > 0) at = lineFreeAt;
+    at += (uint32_t)((uint64_t)framelen * 10000000 / baud);
+    lineFreeAt = at;
+  }
+  Pending *p = &pending[(pendHead + pendCount) % VESC_SIM_PENDING];
+  p->releaseAt = at;
+  p->len = framelen;
+  pendCount++;
+  packetsOut++;
+}
+
+void VescSim::pump(uint32_t now)
+{
+  while (pendCount)
+  {
+    Pending *p = &pending[pendHead];
+    if ((int32_t)(now - p->releaseAt) < 0) break;
+
+    uint8_t frame[VESC_SIM_TXBUF < 1024 ? VESC_SIM_TXBUF : 1024];
+    uint16_t n = p->len - frontSent;
+    if (n > sizeof(frame)) n = sizeof(frame);
+    RingSpans sp = txbuf.readSpans();
+    uint32_t n1 = n < sp.firstlen ? n : sp.firstlen;
+    memcpy(frame, sp.first, n1);
+    memcpy(frame+n1, sp.second, n-n1);
+    if (errorRate > 0)
+      for (uint16_t b = 0; b < n; ++b)
+        if (nextRandom() < errorRate * 4294967295.0f)
+        {
+          frame[b] ^= 1 << (nextRandom() & 7);
+          corrupted++;
+        }
+
+    ssize_t w = write(master, frame, n);
+    if (w <= 0) break;   // client does not read, try next step
+    txbuf.consume(w);
+    frontSent += w;
+    if (frontSent < p->len) break;
+    frontSent = 0;
+    pendHead = (pendHead + 1) % VESC_SIM_PENDING;
+    pendCount--;
+  }
+}
+
+uint32_t VescSim::untilNextEvent_us() const
+{
+  if (!pendCount) return UINT32_MAX;
+  int32_t left = pending[pendHead].releaseAt - micros();
+  return left > 0 ? left : 0;
+}
@@ -0,0 +1,121 @@
+#ifndef _LINUX_VESCSIM_H_
+#define _LINUX_VESCSIM_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdint>
+#include "ringbuffer.h"
+
+// bytes of replies waiting for their release time
+#define VESC_SIM_TXBUF 16384
+// replies waiting for their release time
+#define VESC_SIM_PENDING 64
+// rx buffer, biggest accepted packet
+#define VESC_SIM_RXBUF 1024
+
+/* Simulated VESC on a pseudo-terminal
+
+   Opens pty master, VescUartApi opens the slave like a real /dev/ttyUSB0.
+   Answers COMM_FW_VERSION, COMM_GET_VALUES(_SELECTIVE), COMM_GET_MCCONF(_DEFAULT),
+   COMM_GET_APPCONF(_DEFAULT), COMM_PING_CAN and COMM_TERMINAL_CMD, applies
+   setpoints and COMM_ALIVE to a simple motor model, which also stops the motor
+   after timeout_us without command, like the firmware does.
+
+   Replies leave after latency_us and, with baud set, not sooner than the line
+   could carry them. errorRate flips random bits of outgoing bytes.
+
+   No thread of its own, call step() when master is readable or a reply is due,
+   so one process can run hundreds of them.
+*/
+class VescSim {
+  private:
+    struct Pending {
+      uint32_t releaseAt;
+      uint16_t len;
+    };
+
+    int master;
+    char slavePath[64];
+    uint8_t rx[VESC_SIM_RXBUF];
+    uint16_t rxlen;
+    RingBuffer<VESC_SIM_TXBUF> txbuf;
+    Pending pending[VESC_SIM_PENDING];
+    uint8_t pendHead;
+    uint8_t pendCount;
+    uint16_t frontSent;   // bytes of the front reply already written
+    uint32_t lineFreeAt;
+    uint32_t rng;
+
+    // motor model
+    enum { MODE_RELEASE, MODE_CURRENT, MODE_BRAKE, MODE_DUTY, MODE_RPM };
+    uint8_t mode;
+    float target;
+    float erpm;
+    float motorCurrent;
+    float inputCurrent;
+    float tempFet;
+    float tempMotor;
+    float ampHours;
+    float ampHoursCharged;
+    float wattHours;
+    float wattHoursCharged;
+    float tacho;
+    float tachoAbs;
+    uint32_t lastCmdAt;
+    uint32_t lastModelAt;
+
+    uint32_t nextRandom();
+    void parse(uint32_t now);
+    void process(const uint8_t *payload, uint16_t len, uint32_t now);
+    void reply(const uint8_t *payload, uint16_t len, uint32_t now);
+    void updateModel(uint32_t now);
+    int32_t encodeValues(uint8_t *dst, uint32_t mask);
+    int32_t encodeConf(uint8_t *dst, uint8_t cmd);
+    void pump(uint32_t now);
+
+  public:
+    uint32_t latency_us;
+    int32_t baud;         // 0 = replies are not paced
+    float errorRate;      // probability of corrupted outgoing byte
+    uint32_t timeout_us;  // motor is released after this long without command
+    uint8_t fw[2];
+    uint8_t controllerId;
+    float voltage;
+
+    // stats
+    uint32_t packetsIn;
+    uint32_t packetsOut;
+    uint32_t badIn;       // packets with wrong CRC or termination
+    uint32_t corrupted;   // bytes flipped by error injection
+    uint32_t overflows;   // replies dropped, client does not read
+
+    VescSim(uint32_t seed = 1);
+    ~VescSim();
+
+    // opens pty, link (if not nullptr) becomes symlink to the slave, returns 0 or -errno
+    int open(const char *link = nullptr);
+    const char *path() const { return slavePath; }
+    int handle() const { return master; }
+    // reads what client sent, answers it, sends replies which are due
+    void step();
+    // when step() has to be called even without input, UINT32_MAX if nothing waits
+    uint32_t untilNextEvent_us() const;
+    float rpm() const { return erpm; }
+};
+
+#endif /* _LINUX_VESCSIM_H_ */
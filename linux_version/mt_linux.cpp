@@ -0,0 +1,126 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "linux_iothread.h"
+#include "vesckeepalive.h"
+#include "datatypes.h"
+
+/* Several threads driving one VESC: planner sends setpoints, safety monitor
+   watches values and can stop the motor, UI polls values and asks for firmware
+   version. None of them touches the port, I/O thread does.
+*/
+
+static volatile bool quit;
+static uint32_t fwAnswers;
+
+static void *planner(void *arg)
+{
+  VescThreadedPort *port = (VescThreadedPort*)arg;
+  for (int32_t i = 0; !quit; ++i)
+  {
+    port->setCurrent(1000 + (i % 500));
+    usleep(2000);
+  }
+  return nullptr;
+}
+
+static void *safety(void *arg)
+{
+  VescThreadedPort *port = (VescThreadedPort*)arg;
+  ValuesData v;
+  while (!quit)
+  {
+    if (port->values(&v) && v.fault)
+    {
+      printf("safety: fault %d, stopping motor\n", v.fault);
+      port->setCurrent(0);
+    }
+    usleep(10000);
+  }
+  return nullptr;
+}
+
+static void onFw(void *, VescUartApi *, const uint8_t *packet, uint16_t packetsize)
+{
+  if (packet[0] == COMM_FW_VERSION && packetsize >= 3) __atomic_fetch_add(&fwAnswers, 1, __ATOMIC_RELAXED);
+}
+
+static void *ui(void *arg)
+{
+  VescThreadedPort *port = (VescThreadedPort*)arg;
+  VescPacketListener fw = { onFw, nullptr, nullptr };
+  port->subscribe(&fw);
+  const uint8_t askFw[] = { COMM_FW_VERSION };
+  for (int i = 0; !quit; ++i)
+  {
+    port->askValues();
+    if (!(i % 10)) port->sendCommand(askFw, sizeof(askFw));
+    usleep(50000);
+  }
+  port->unsubscribe(&fw);
+  return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+  VescThreadedPort port(argc > 1 ? argv[1] : "/dev/ttyUSB0");
+  if (port.begin(115200) < 0)
+    exit(1);
+
+  VescIoThread io;
+  if (io.add(&port) < 0)
+    exit(1);
+  // stop the motor if planner stops sending
+  VescKeepalive keepalive(&io.wheel, &port.vesc);
+  keepalive.appTimeout_us = 100000;
+  keepalive.start();
+  // planner sends the same value often, don't put every one of them on the wire
+  port.vesc.setCoalescing(true, 5000);
+
+  int err = io.start();
+  if (err < 0)
+  {
+    printf("Error: can't start I/O thread: %s\n", strerror(-err));
+    exit(1);
+  }
+
+  pthread_t threads[3];
+  pthread_create(&threads[0], nullptr, planner, &port);
+  pthread_create(&threads[1], nullptr, safety, &port);
+  pthread_create(&threads[2], nullptr, ui, &port);
+  sleep(3);
+  quit = true;
+  for (int i = 0; i < 3; ++i) pthread_join(threads[i], nullptr);
+
+  port.setCurrent(0);
+  io.stop();
+  while (port.serial()->txPending() && port.serial()->flushTx() >= 0)
+    usleep(1000);
+
+  ValuesData v;
+  uint32_t seq = 0;
+  port.values(&v, &seq);
+  printf("%u commands, %u refused, %u values updates, %u firmware answers\n", port.submitted, port.queueFull,
+         seq, fwAnswers);
+  printf("I/O thread: %llu loops, %llu wakeups, %u setpoints coalesced, %u suppressed\n",
+         (unsigned long long)io.loops, (unsigned long long)io.wakeups, port.vesc.setpointsCoalesced,
+         port.vesc.setpointsSuppressed);
+  return 0;
+}
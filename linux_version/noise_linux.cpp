@@ -0,0 +1,441 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <time.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "vescuartapi.h"
+#include "datatypes.h"
+#include "crc.h"
+
+/* Deterministic noise benchmark of the framer. Stream of valid frames is damaged
+   by bit errors, dropped bytes and inserted 0x02/0x03 bytes at given rates and fed
+   to loopstep() through a pipe in chunks, like reads from a uart. Measures how many
+   undamaged frames get through, how many bytes it takes to deliver the first good
+   frame after damage (resync latency) and CPU per byte. Then checks that the cost
+   of line noise and of pathological patterns grows linearly with stream length.
+   JSON on stdout, summary on stderr.
+*/
+
+#define RXBUF 1024
+// superlinear check, cost per byte of long stream vs short one
+#define SCALE_SHORT 16384
+#define SCALE_LONG 65536
+#define SCALE_RUNS 3
+#define SCALE_CHUNK 4096
+#define LATENCY_BUCKETS 1100
+
+struct Frame {
+  uint32_t cleanAt;     // payload offset in clean stream
+  uint16_t payloadLen;
+  uint32_t noisyEnd;    // offset after the last byte in damaged stream
+  bool damaged;
+  bool delivered;
+  uint32_t deliveredAt; // bytes fed when it came out of the framer
+};
+
+struct Stream {
+  uint8_t *clean;
+  uint8_t *noisy;
+  uint32_t cleanLen;
+  uint32_t noisyLen;
+  Frame *frames;
+  uint32_t nframes;
+};
+
+struct Counters {
+  uint32_t good;        // undamaged frame delivered intact
+  uint32_t ghosts;      // delivered payload which was not sent
+  uint32_t duplicates;
+};
+
+static uint64_t rnd;
+static uint64_t nextRandom()
+{
+  // xorshift64
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 7;
+  rnd ^= rnd << 17;
+  return rnd;
+}
+static double nextUniform() { return (nextRandom() >> 11) * (1.0 / 9007199254740992.0); }
+
+static HardwareSerial uart("noise");
+static int pipewr;
+alignas(VescUartApiStatic<RXBUF>) static uint8_t apiStorage[sizeof(VescUartApiStatic<RXBUF>)];
+static uint32_t bytesFed;
+static Stream *cur;
+static Counters counters;
+
+static uint64_t cpuNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void onPacket(void *, VescUartApi *, const uint8_t *packet, uint16_t size)
+{
+  if (!cur) return;
+  uint32_t seq = size >= 5 ? ((uint32_t)packet[1] << 24) | ((uint32_t)packet[2] << 16) | ((uint32_t)packet[3] << 8) | packet[4] : 0xffffffff;
+  Frame *f = seq < cur->nframes ? &cur->frames[seq] : nullptr;
+  if (!f || f->payloadLen != size || memcmp(cur->clean + f->cleanAt, packet, size))
+  {
+    counters.ghosts++;
+    return;
+  }
+  if (f->delivered)
+  {
+    counters.duplicates++;
+    return;
+  }
+  f->delivered = true;
+  f->deliveredAt = bytesFed;
+  if (!f->damaged) counters.good++;
+}
+
+static VescPacketListener listener = { onPacket, nullptr, nullptr };
+
+// fresh framer for every run, so runs don't influence each other
+static VescUartApi *freshApi()
+{
+  VescUartApi *vesc = new (apiStorage) VescUartApiStatic<RXBUF>(&uart);
+  vesc->addPacketListener(&listener);
+  return vesc;
+}
+
+// feeds data in chunks, adds them to bytesFed, returns CPU time spent in loopstep()
+static uint64_t feed(VescUartApi *vesc, const uint8_t *data, uint32_t len, uint32_t chunk)
+{
+  uint64_t took = 0;
+  for (uint32_t done = 0; done < len; )
+  {
+    uint32_t n = len - done < chunk ? len - done : chunk;
+    if (write(pipewr, data + done, n) != (ssize_t)n)
+    {
+      printf("write to pipe failed: %m\n");
+      exit(1);
+    }
+    done += n;
+    bytesFed += n;
+    uint64_t start = cpuNs();
+    vesc->loopstep();
+    took += cpuNs() - start;
+  }
+  return took;
+}
+
+static uint32_t appendFrame(uint8_t *dst, uint32_t seq, uint16_t len, uint8_t cmd)
+{
+  uint32_t index = 0;
+  if (len < 256) { dst[index++] = 2; dst[index++] = len; }
+  else { dst[index++] = 3; dst[index++] = len >> 8; dst[index++] = len & 0xff; }
+  uint8_t *payload = dst + index;
+  payload[0] = cmd;
+  payload[1] = seq >> 24;
+  payload[2] = seq >> 16;
+  payload[3] = seq >> 8;
+  payload[4] = seq;
+  for (uint16_t i = 5; i < len; ++i) payload[i] = nextRandom();
+  index += len;
+  uint16_t crc = crc16(payload, len);
+  dst[index++] = crc >> 8;
+  dst[index++] = crc & 0xff;
+  dst[index++] = 3;
+  return index;
+}
+
+/* Frame mix of a polling application: 60 % COMM_GET_VALUES replies, 30 % short
+   ones, 10 % long configuration frames with 3 byte header.
+*/
+static void buildStream(Stream *s, uint32_t nframes, double bitRate, double dropRate, double insertRate)
+{
+  s->nframes = nframes;
+  s->frames = (Frame*)malloc(sizeof(Frame) * nframes);
+  s->clean = (uint8_t*)malloc((size_t)nframes * 410);
+  s->cleanLen = 0;
+  for (uint32_t n = 0; n < nframes; ++n)
+  {
+    uint32_t kind = nextRandom() % 10;
+    uint16_t len = kind < 6 ? 70 : (kind < 9 ? 5 : 400);
+    uint8_t cmd = kind < 6 ? COMM_GET_VALUES : (kind < 9 ? COMM_ALIVE : COMM_GET_MCCONF);
+    Frame *f = &s->frames[n];
+    f->cleanAt = s->cleanLen + (len < 256 ? 2 : 3);
+    f->payloadLen = len;
+    f->damaged = false;
+    f->delivered = false;
+    s->cleanLen += appendFrame(s->clean + s->cleanLen, n, len, cmd);
+  }
+
+  // every clean byte can gain insert before it, flipped bit or get dropped
+  s->noisy = (uint8_t*)malloc((size_t)s->cleanLen * 2 + 16);
+  s->noisyLen = 0;
+  uint32_t fi = 0;
+  uint32_t frameStart = 0;
+  for (uint32_t i = 0; i < s->cleanLen; ++i)
+  {
+    Frame *f = &s->frames[fi];
+    uint32_t frameEnd = f->cleanAt + f->payloadLen + 3;
+    // insert between frames damages nothing
+    bool first = i == frameStart;
+    if (insertRate > 0 && nextUniform() < insertRate)
+    {
+      s->noisy[s->noisyLen++] = 2 + (nextRandom() & 1);
+      if (!first) f->damaged = true;
+    }
+    uint8_t b = s->clean[i];
+    if (bitRate > 0 && nextUniform() < bitRate)
+    {
+      b ^= 1 << (nextRandom() % 8);
+      f->damaged = true;
+    }
+    if (dropRate > 0 && nextUniform() < dropRate) f->damaged = true;
+    else s->noisy[s->noisyLen++] = b;
+    if (i + 1 == frameEnd)
+    {
+      f->noisyEnd = s->noisyLen;
+      frameStart = frameEnd;
+      fi++;
+    }
+  }
+}
+
+static void freeStream(Stream *s)
+{
+  free(s->clean);
+  free(s->noisy);
+  free(s->frames);
+}
+
+struct RunResult {
+  uint32_t frames;
+  uint32_t damaged;
+  double recovered_pct;   // undamaged frames which got through
+  uint32_t ghosts;
+  uint32_t resyncs;
+  double resync_mean;
+  uint32_t resync_p99;
+  uint32_t resync_max;
+  double ns_per_byte;
+};
+
+static RunResult runStream(Stream *s, uint32_t chunk)
+{
+  static uint32_t hist[LATENCY_BUCKETS];
+  memset(hist, 0, sizeof(hist));
+  memset(&counters, 0, sizeof(counters));
+  cur = s;
+  VescUartApi *vesc = freshApi();
+  bytesFed = 0;
+  uint64_t took = feed(vesc, s->noisy, s->noisyLen, chunk);
+  // idle line followed by other traffic, lets framer give up candidates still waiting for their length
+  static const uint8_t idle[RXBUF] = { 0 };
+  feed(vesc, idle, sizeof(idle), chunk);
+  cur = nullptr;
+
+  RunResult r;
+  memset(&r, 0, sizeof(r));
+  r.frames = s->nframes;
+  uint32_t undamaged = 0;
+  uint64_t latencySum = 0;
+  bool afterDamage = false;
+  for (uint32_t n = 0; n < s->nframes; ++n)
+  {
+    Frame *f = &s->frames[n];
+    if (f->damaged)
+    {
+      r.damaged++;
+      afterDamage = true;
+      continue;
+    }
+    undamaged++;
+    if (!f->delivered || !afterDamage) continue;
+    // bytes which had to come after the frame before framer got it, without chunking
+    uint32_t readEnd = (f->noisyEnd + chunk - 1) / chunk * chunk;
+    uint32_t lat = f->deliveredAt > readEnd ? f->deliveredAt - readEnd : 0;
+    hist[lat < LATENCY_BUCKETS ? lat : LATENCY_BUCKETS-1]++;
+    latencySum += lat;
+    if (lat > r.resync_max) r.resync_max = lat;
+    r.resyncs++;
+    afterDamage = false;
+  }
+  r.recovered_pct = undamaged ? 100.0 * counters.good / undamaged : 100.0;
+  r.ghosts = counters.ghosts + counters.duplicates;
+  r.resync_mean = r.resyncs ? (double)latencySum / r.resyncs : 0;
+  uint32_t want = (uint32_t)(r.resyncs * 0.99), seen = 0;
+  for (uint32_t b = 0; b < LATENCY_BUCKETS && r.resyncs; ++b)
+  {
+    seen += hist[b];
+    if (seen > want) { r.resync_p99 = b; break; }
+  }
+  r.ns_per_byte = s->noisyLen ? (double)took / s->noisyLen : 0;
+  return r;
+}
+
+// cost per byte of data tiled to len bytes, best of SCALE_RUNS
+static double costPerByte(const uint8_t *data, uint32_t datalen, uint32_t len)
+{
+  static uint8_t buf[SCALE_LONG];
+  for (uint32_t i = 0; i < len; ++i) buf[i] = data[i % datalen];
+  double best = 0;
+  for (int r = 0; r < SCALE_RUNS; ++r)
+  {
+    double c = (double)feed(freshApi(), buf, len, SCALE_CHUNK) / len;
+    if (!r || c < best) best = c;
+  }
+  return best;
+}
+
+struct Pattern {
+  const char *name;
+  uint8_t data[SCALE_SHORT];
+  uint32_t len;
+  double short_ns;
+  double long_ns;
+};
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-e bit error rate] [-d drop rate] [-i insert rate] [-n frames] [-c chunk bytes] [-s seed] [-x max ratio]\n"
+         "  rates are per byte, default -e 1e-4 -d 1e-4 -i 1e-4 -n 20000 -c 64 -x 2\n"
+         "  -x is the long/short cost per byte ratio which is reported as superlinear\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  double bitRate = 1e-4, dropRate = 1e-4, insertRate = 1e-4, maxRatio = 2;
+  uint32_t nframes = 20000, chunk = 64;
+  uint64_t seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:d:i:n:c:s:x:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'e': bitRate = atof(optarg); break;
+      case 'd': dropRate = atof(optarg); break;
+      case 'i': insertRate = atof(optarg); break;
+      case 'n': nframes = atoi(optarg); break;
+      case 'c': chunk = atoi(optarg); break;
+      case 's': seed = strtoull(optarg, nullptr, 0); break;
+      case 'x': maxRatio = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || !nframes || !chunk || chunk > SCALE_CHUNK || maxRatio <= 1) usage(argv[0]);
+
+  int fds[2];
+  if (pipe(fds) < 0 || uart.attach(fds[0]) < 0)
+  {
+    printf("pipe failed: %m\n");
+    return 1;
+  }
+  pipewr = fds[1];
+
+  // same frames with and without noise, clean run is the baseline
+  Stream clean, noisy;
+  rnd = seed * 0x9e3779b97f4a7c15ull | 1;
+  buildStream(&clean, nframes, 0, 0, 0);
+  rnd = seed * 0x9e3779b97f4a7c15ull | 1;
+  buildStream(&noisy, nframes, bitRate, dropRate, insertRate);
+  RunResult base = runStream(&clean, chunk);
+  RunResult res = runStream(&noisy, chunk);
+
+  fprintf(stderr, "clean: %u frames, %.2f %% recovered, %.2f ns/B\n", base.frames, base.recovered_pct, base.ns_per_byte);
+  fprintf(stderr, "noisy: %u frames, %u damaged, %.2f %% of undamaged recovered, %u ghosts, %.2f ns/B (%.2fx)\n",
+          res.frames, res.damaged, res.recovered_pct, res.ghosts, res.ns_per_byte, res.ns_per_byte / base.ns_per_byte);
+  fprintf(stderr, "resync after damage: %u times, mean %.1f B, p99 %u B, max %u B\n",
+          res.resyncs, res.resync_mean, res.resync_p99, res.resync_max);
+
+  // noisy stream and patterns which make framer wait for long candidates or CRC them over and over
+  static Pattern patterns[8];
+  int npat = 0;
+  Pattern *p = &patterns[npat++];
+  p->name = "clean_stream";
+  p->len = clean.cleanLen < SCALE_SHORT ? clean.cleanLen : SCALE_SHORT;
+  memcpy(p->data, clean.clean, p->len);
+  p = &patterns[npat++];
+  p->name = "noisy_stream";
+  p->len = noisy.noisyLen < SCALE_SHORT ? noisy.noisyLen : SCALE_SHORT;
+  memcpy(p->data, noisy.noisy, p->len);
+  p = &patterns[npat++];
+  p->name = "random";
+  p->len = SCALE_SHORT;
+  for (uint32_t i = 0; i < p->len; ++i) p->data[i] = nextRandom();
+  p = &patterns[npat++];
+  p->name = "all_02";
+  p->len = 1;
+  p->data[0] = 2;
+  p = &patterns[npat++];
+  p->name = "all_03";
+  p->len = 1;
+  p->data[0] = 3;
+  p = &patterns[npat++];
+  p->name = "02_ff";
+  p->len = 2;
+  p->data[0] = 2;
+  p->data[1] = 0xff;
+  p = &patterns[npat++];
+  p->name = "03_03_fa";
+  p->len = 3;
+  p->data[0] = 3;
+  p->data[1] = 3;
+  p->data[2] = 0xfa;
+  p = &patterns[npat++];
+  // every byte starts a candidate with its end byte in place, each one fails CRC
+  p->name = "02_fa_end_03";
+  p->len = 256;
+  p->data[0] = 2;
+  p->data[1] = 0xfa;
+  for (uint32_t i = 2; i < p->len; ++i) p->data[i] = (i % 2) ? 3 : 2;
+
+  bool superlinear = false;
+  for (int i = 0; i < npat; ++i)
+  {
+    p = &patterns[i];
+    p->short_ns = costPerByte(p->data, p->len, SCALE_SHORT);
+    p->long_ns = costPerByte(p->data, p->len, SCALE_LONG);
+    bool bad = p->long_ns > maxRatio * p->short_ns;
+    superlinear |= bad;
+    fprintf(stderr, "%-14s %8.2f ns/B short, %8.2f ns/B long, %6.1fx clean%s\n", p->name, p->short_ns, p->long_ns,
+            p->long_ns / patterns[0].long_ns, bad ? "  SUPERLINEAR" : "");
+  }
+
+  printf("{\n  \"seed\": %llu,\n  \"bit_error_rate\": %g,\n  \"drop_rate\": %g,\n  \"insert_rate\": %g,\n  \"chunk\": %u,\n",
+         (unsigned long long)seed, bitRate, dropRate, insertRate, chunk);
+  printf("  \"frames\": %u,\n  \"damaged\": %u,\n  \"recovered_pct\": %.3f,\n  \"ghosts\": %u,\n",
+         res.frames, res.damaged, res.recovered_pct, res.ghosts);
+  printf("  \"resyncs\": %u,\n  \"resync_bytes_mean\": %.2f,\n  \"resync_bytes_p99\": %u,\n  \"resync_bytes_max\": %u,\n",
+         res.resyncs, res.resync_mean, res.resync_p99, res.resync_max);
+  printf("  \"clean_ns_per_byte\": %.3f,\n  \"noisy_ns_per_byte\": %.3f,\n  \"scaling\": [\n",
+         base.ns_per_byte, res.ns_per_byte);
+  for (int i = 0; i < npat; ++i)
+  {
+    p = &patterns[i];
+    printf("    {\"name\": \"%s\", \"ns_per_byte_short\": %.3f, \"ns_per_byte_long\": %.3f, \"vs_clean\": %.2f, \"superlinear\": %s}%s\n",
+           p->name, p->short_ns, p->long_ns, p->long_ns / patterns[0].long_ns, p->long_ns > maxRatio * p->short_ns ? "true" : "false", i + 1 < npat ? "," : "");
+  }
+  printf("  ],\n  \"superlinear\": %s\n}\n", superlinear ? "true" : "false");
+
+  freeStream(&clean);
+  freeStream(&noisy);
+  return superlinear ? 2 : 0;
+}
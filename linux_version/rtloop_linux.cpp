@@ -0,0 +1,122 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "linux_rtloop.h"
+#include "vescuartapi.h"
+#include "vescpoller.h"
+#include "vesckeepalive.h"
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-r rate Hz] [-t seconds] [-b baud] [-p fifo priority] [-c cpu] [-m] <serial port>\n"
+         "  -m  lock memory\n", name);
+  exit(1);
+}
+
+struct Ctx {
+  VescTelemetryPoller *poller;
+  VescTimerWheel *wheel;
+  VescUartApi *vesc;
+  uint32_t setpoints;
+};
+
+static void tick(VescControlLoop *loop, const ValuesData *values, bool fresh)
+{
+  Ctx *ctx = (Ctx*)loop->userdata;
+  ctx->poller->loopstep();
+  ctx->wheel->loopstep();
+  // close the loop on telemetry: new setpoint only with new values, keepalive covers the rest
+  if (fresh)
+  {
+    // hold 3000 rpm with simple P controller, limited to 2 A
+    int32_t ma = (3000 - (int32_t)values->rpm) * 2;
+    if (ma > 2000) ma = 2000;
+    if (ma < -2000) ma = -2000;
+    ctx->vesc->setCurrent(ma);
+    ctx->setpoints++;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int rate = 1000, seconds = 5, baud = 115200, opt;
+  int prio = 0, cpu = -1;
+  bool lock = false;
+
+  while ((opt = getopt(argc, argv, "r:t:b:p:c:m")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r': rate = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'b': baud = atoi(optarg); break;
+      case 'p': prio = atoi(optarg); break;
+      case 'c': cpu = atoi(optarg); break;
+      case 'm': lock = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || rate <= 0 || rate > 100000) usage(argv[0]);
+
+  HardwareSerial uart(argv[optind]);
+  VescUartApiStatic<1024> vesc(&uart);
+  if (uart.begin(baud) < 0)
+    exit(1);
+
+  VescTelemetryPoller poller(&vesc, baud);
+  VescTimerWheel wheel(1000);
+  VescKeepalive keepalive(&wheel, &vesc);
+  keepalive.appTimeout_us = 100000;
+  keepalive.start();
+
+  Ctx ctx = { &poller, &wheel, &vesc, 0 };
+  VescControlLoop loop(&vesc, 1000000 / rate);
+  loop.fifoPriority = prio;
+  loop.cpu = cpu;
+  loop.lockMemory = lock;
+  loop.userdata = &ctx;
+  loop.setTickCB(tick);
+  if (loop.setup() < 0)
+  {
+    if (loop.setupFailed & VescControlLoop::RT_PIN)
+      printf("Warning: can't pin to CPU %d\n", cpu);
+    if (loop.setupFailed & VescControlLoop::RT_FIFO)
+      printf("Warning: can't set SCHED_FIFO priority %d\n", prio);
+    if (loop.setupFailed & VescControlLoop::RT_MLOCK)
+      printf("Warning: can't lock memory\n");
+  }
+
+  int ret = loop.run((uint64_t)rate * seconds);
+  if (ret < 0)
+    printf("Error: control loop failed: %s\n", strerror(-ret));
+
+  printf("%llu ticks of %u us, %llu overruns\n", (unsigned long long)loop.ticks, loop.period_us(),
+         (unsigned long long)loop.overruns);
+  printf("jitter: min %u us, mean %u us, p99 %u us, max %u us\n", loop.minJitter_ns / 1000,
+         loop.meanJitter_ns() / 1000, loop.jitterPercentile_us(99), loop.maxJitter_ns / 1000);
+  printf("values at %u Hz, %u setpoints, %u keepalives, %u failsafes\n", poller.rateHz(), ctx.setpoints,
+         keepalive.keepalives, keepalive.failsafes);
+
+  vesc.setCurrent(0);
+  while (uart.txPending() && uart.flushTx() >= 0)
+    usleep(1000);
+  return ret < 0;
+}
@@ -0,0 +1,325 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "linux_vescsim.h"
+#include "vescuartapi.h"
+#include "datatypes.h"
+
+/* Scaling benchmark: N simulated VESCs on ptys driven by one thread through
+   the polling API (epoll + loopstep()), each port keeps one COMM_GET_VALUES in
+   flight. Simulators run in a child process, so only library CPU is measured.
+*/
+
+// round trip histogram, 10 us buckets up to 100 ms
+#define RTT_BUCKETS 10000
+#define RTT_BUCKET_US 10
+
+struct Port {
+  HardwareSerial uart;
+  VescUartApiStatic<1024> vesc;
+  VescPacketListener listener;
+  uint32_t sentAt;
+  bool waiting;
+  Port(const char *path) : uart(path), vesc(&uart), sentAt(0), waiting(false) { }
+};
+
+static uint32_t rttHist[RTT_BUCKETS+1];
+static uint64_t replies;
+static uint64_t lost;
+static bool measuring;
+
+static void ask(Port *p, uint32_t now)
+{
+  p->vesc.askValues();
+  p->sentAt = now;
+  p->waiting = true;
+}
+
+// closed loop, next request goes right after the answer
+static void onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t)
+{
+  Port *p = (Port*)ctx;
+  if (packet[0] != COMM_GET_VALUES || !p->waiting) return;
+  uint32_t now = micros();
+  if (measuring)
+  {
+    uint32_t rtt = (now - p->sentAt) / RTT_BUCKET_US;
+    rttHist[rtt < RTT_BUCKETS ? rtt : RTT_BUCKETS]++;
+    replies++;
+  }
+  ask(p, now);
+}
+
+static uint32_t percentile(uint64_t total, uint32_t permille)
+{
+  uint64_t want = (total * permille + 999) / 1000, seen = 0;
+  for (uint32_t i = 0; i <= RTT_BUCKETS; ++i)
+  {
+    seen += rttHist[i];
+    if (seen >= want && want) return i * RTT_BUCKET_US;
+  }
+  return RTT_BUCKETS * RTT_BUCKET_US;
+}
+
+static long rssKiB()
+{
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+  fclose(f);
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double cpuSeconds()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// child: n simulators until killed, tells parent over pipe when links exist
+static void runSims(int n, const char *prefix, int baud, uint32_t latency, int readyfd)
+{
+  VescSim *sims = (VescSim*)malloc(sizeof(VescSim) * n);
+  int ep = epoll_create1(0);
+  if (!sims || ep < 0) exit(1);
+  for (int i = 0; i < n; ++i)
+  {
+    char link[256];
+    snprintf(link, sizeof(link), "%s%d", prefix, i);
+    new (&sims[i]) VescSim(i + 1);
+    sims[i].baud = baud;
+    sims[i].latency_us = latency;
+    sims[i].controllerId = i;
+    if (sims[i].open(link) < 0) exit(1);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sims[i].handle(), &ev);
+  }
+  if (write(readyfd, "r", 1) != 1) exit(1);
+
+  struct epoll_event events[256];
+  uint32_t lastSweep = micros();
+  for (;;)
+  {
+    int cnt = epoll_wait(ep, events, 256, 1);
+    for (int i = 0; i < cnt; ++i) sims[events[i].data.u32].step();
+    // delayed replies of ports which did not send anything since
+    if (micros() - lastSweep > 1000)
+    {
+      lastSweep = micros();
+      for (int i = 0; i < n; ++i)
+        if (sims[i].untilNextEvent_us() != UINT32_MAX) sims[i].step();
+    }
+  }
+}
+
+// kills simulators and removes their links
+static void stopSims(pid_t child, int n, const char *prefix)
+{
+  kill(child, SIGKILL);
+  waitpid(child, nullptr, 0);
+  for (int i = 0; i < n; ++i)
+  {
+    char link[256];
+    snprintf(link, sizeof(link), "%s%d", prefix, i);
+    unlink(link);
+  }
+}
+
+// constructs ports in place, opened counts the constructed ones, also on failure
+static int openPorts(Port *ports, int n, int ep, const char *prefix, int *opened)
+{
+  for (int i = 0; i < n; ++i)
+  {
+    char link[256];
+    snprintf(link, sizeof(link), "%s%d", prefix, i);
+    Port *p = new (&ports[i]) Port(link);
+    (*opened)++;
+    if (p->uart.begin(115200) < 0) return -1;
+    p->listener.cb = onPacket;
+    p->listener.ctx = p;
+    p->listener.next = nullptr;
+    p->vesc.addPacketListener(&p->listener);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, p->uart.handle(), &ev) < 0) return -errno;
+  }
+  return 0;
+}
+
+static int runOne(int n, const char *prefix, int baud, uint32_t latency, uint32_t seconds)
+{
+  int pipefd[2];
+  if (pipe(pipefd) < 0) return -errno;
+  pid_t parent = getpid();
+  pid_t child = fork();
+  if (child < 0)
+  {
+    int err = -errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return err;
+  }
+  if (!child)
+  {
+    // don't outlive the benchmark, whichever way it ends
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) exit(1);
+    close(pipefd[0]);
+    runSims(n, prefix, baud, latency, pipefd[1]);
+    exit(0);
+  }
+  close(pipefd[1]);
+  char c;
+  if (read(pipefd[0], &c, 1) != 1)
+  {
+    printf("Error: simulators did not start\n");
+    close(pipefd[0]);
+    stopSims(child, n, prefix);
+    return -1;
+  }
+  close(pipefd[0]);
+
+  long rssBefore = rssKiB();
+  Port *ports = (Port*)malloc(sizeof(Port) * n);
+  int ep = epoll_create1(0);
+  int opened = 0;
+  if (!ports || ep < 0 || openPorts(ports, n, ep, prefix, &opened) < 0)
+  {
+    printf("Error: can't open %d ports\n", n);
+    for (int i = 0; i < opened; ++i) ports[i].~Port();
+    free(ports);
+    if (ep >= 0) close(ep);
+    stopSims(child, n, prefix);
+    return -1;
+  }
+  long rssAfter = rssKiB();
+
+  for (uint32_t i = 0; i <= RTT_BUCKETS; ++i) rttHist[i] = 0;
+  replies = lost = 0;
+  measuring = false;
+
+  struct epoll_event events[256];
+  uint32_t start = micros(), measureStart = 0, lastSweep = start;
+  double cpuStart = 0;
+  const uint32_t warmup = 500000;
+  for (int i = 0; i < n; ++i) ask(&ports[i], start);
+  for (;;)
+  {
+    uint32_t now = micros();
+    if (!measuring && now - start > warmup)
+    {
+      measuring = true;
+      measureStart = now;
+      cpuStart = cpuSeconds();
+    }
+    if (measuring && now - measureStart > seconds * 1000000) break;
+
+    // answers lost in the pty are asked again, it's 10 ms sweep, not per loop
+    if (now - lastSweep > 10000)
+    {
+      lastSweep = now;
+      for (int i = 0; i < n; ++i)
+        if (now - ports[i].sentAt > 100000)
+        {
+          if (measuring) lost++;
+          ask(&ports[i], now);
+        }
+    }
+    int cnt = epoll_wait(ep, events, 256, 10);
+    for (int i = 0; i < cnt; ++i) ((Port*)events[i].data.ptr)->vesc.loopstep();
+  }
+  double cpu = cpuSeconds() - cpuStart;
+  double elapsed = (micros() - measureStart) / 1e6;
+
+  printf("%5d %10.0f %9.1f %7.1f %8.1f %7.0f %7u %7u %6lu %7lu %6.1f\n", n, replies / elapsed, replies / elapsed / n,
+         100.0 * cpu / elapsed, 1e6 * cpu / elapsed / n, replies ? 1e9 * cpu / replies : 0.0,
+         percentile(replies, 500), percentile(replies, 990), (unsigned long)sizeof(Port),
+         (unsigned long)((rssAfter - rssBefore) * 1024 / n), 100.0 * lost / (replies + lost ? replies + lost : 1));
+  fflush(stdout);
+
+  for (int i = 0; i < n; ++i) ports[i].~Port();
+  free(ports);
+  close(ep);
+  stopSims(child, n, prefix);
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-n ports[,ports...]] [-d seconds] [-b sim baud] [-l sim latency us] [link prefix]\n"
+         "  defaults: -n 1,8,64,256,512 -d 3 -b 0 (unpaced) -l 0, prefix /tmp/vescscale\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *counts = "1,8,64,256,512";
+  int baud = 0, opt;
+  uint32_t latency = 0, seconds = 3;
+
+  while ((opt = getopt(argc, argv, "n:d:b:l:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': counts = optarg; break;
+      case 'd': seconds = atoi(optarg); break;
+      case 'b': baud = atoi(optarg); break;
+      case 'l': latency = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 < argc || !seconds) usage(argv[0]);
+  const char *prefix = optind < argc ? argv[optind] : "/tmp/vescscale";
+
+  // two fds per port, one in each process, plus epoll and spare
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  printf("ports   pkts/s  pkts/s/port   cpu%%  cpu us/s/port  ns/pkt  p50 us  p99 us  B/port  RSS B/port  lost%%\n");
+  for (const char *c = counts; *c; )
+  {
+    int n = atoi(c);
+    if (n < 1 || n > 4096) usage(argv[0]);
+    if ((rlim_t)n + 16 > rl.rlim_cur)
+    {
+      printf("Error: %d ports need more open files than RLIMIT_NOFILE allows\n", n);
+      return 1;
+    }
+    if (runOne(n, prefix, baud, latency, seconds) < 0) return 1;
+    while (*c && *c != ',') c++;
+    if (*c) c++;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "vescuartapi.h"
+#include "vescterminal.h"
+
+// print VESC's terminal output as it comes
+void lineCB(VescTerminal *, const char *line) { printf("%s\n", line); fflush(stdout); }
+
+bool gotvalues;
+void valuesCB(VescUartApi *) { gotvalues = true; }
+
+int main(int argc, char *argv[])
+{
+  uint8_t vescbuffer[1024];
+  char cmd[VESC_TERM_QUEUE];
+  int cmdlen = 0;
+
+  HardwareSerial uart(argc > 1 ? argv[1] : "/dev/ttyUSB0");
+  VescUartApi vesc(vescbuffer, sizeof(vescbuffer), &uart);
+  if (uart.begin(115200) < 0)
+    exit(1);
+
+  VescTerminal term(&vesc);
+  term.setLineCB(lineCB);
+  vesc.setRxDataCB(COMM_PACKET_ID::COMM_GET_VALUES, valuesCB);
+
+  printf("Type VESC terminal commands (faults, hw_status, help, ...), values are polled meanwhile\n");
+  uint32_t lastask = 0;
+  uint32_t lastprint = micros();
+  for(;;)
+  {
+    // commands from stdin, line by line, without blocking
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) > 0)
+    {
+      char c;
+      if (::read(0, &c, 1) <= 0) break;
+      if (c == '\n')
+      {
+        cmd[cmdlen] = 0;
+        if (cmdlen && !term.command(cmd))
+          printf("Error: command queue full\n");
+        cmdlen = 0;
+      }
+      else if (cmdlen < (int)sizeof(cmd)-1)
+        cmd[cmdlen++] = c;
+    }
+
+    vesc.loopstep();
+    term.loopstep();
+
+    // telemetry keeps going while terminal commands run
+    if (micros() - lastask > 100000)
+    {
+      vesc.askValues();
+      lastask = micros();
+    }
+    if (gotvalues && micros() - lastprint > 5000000)
+    {
+      printf("[rpm: %d voltage: %2.02f fault: %d]\n", (int)vesc.values_data.rpm,
+             vesc.values_data.input_voltage, vesc.values_data.fault);
+      lastprint = micros();
+      gotvalues = false;
+    }
+    usleep(1000);
+  }
+
+  // let queued commands finish
+  while (!term.idle())
+  {
+    vesc.loopstep();
+    term.loopstep();
+    usleep(1000);
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <poll.h>
+#include <unistd.h>
+#include "linux_hwserial.h"
+#include "linux_vescsim.h"
+
+/* Standalone simulator: N simulated VESCs, each one on a pty with symlink
+   <prefix>0, <prefix>1, ... which any VescUartApi program can open as its port.
+*/
+
+static volatile bool quit;
+static void onSignal(int) { quit = true; }
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-n count] [-l latency us] [-b baud] [-e byte error rate] [-s seed] [link prefix]\n"
+         "  default prefix /tmp/vescsim, -b 0 disables pacing\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int count = 1, baud = 115200, opt;
+  uint32_t latency = 200, seed = 1;
+  float errors = 0;
+
+  while ((opt = getopt(argc, argv, "n:l:b:e:s:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': count = atoi(optarg); break;
+      case 'l': latency = atoi(optarg); break;
+      case 'b': baud = atoi(optarg); break;
+      case 'e': errors = atof(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (count < 1 || count > 4096 || optind + 1 < argc) usage(argv[0]);
+  const char *prefix = optind < argc ? argv[optind] : "/tmp/vescsim";
+
+  // no libstdc++ in linking, so no new[], placement new is inline
+  VescSim *sims = (VescSim*)malloc(sizeof(VescSim) * count);
+  struct pollfd *fds = (struct pollfd*)malloc(sizeof(struct pollfd) * count);
+  if (!sims || !fds) return 1;
+  for (int i = 0; i < count; ++i)
+  {
+    char link[256];
+    snprintf(link, sizeof(link), "%s%d", prefix, i);
+    // every one gets its own error pattern, still reproducible
+    new (&sims[i]) VescSim(seed + i);
+    sims[i].latency_us = latency;
+    sims[i].baud = baud;
+    sims[i].errorRate = errors;
+    sims[i].controllerId = i;
+    int err = sims[i].open(link);
+    if (err < 0)
+    {
+      printf("Error: can't create %s: %s\n", link, strerror(-err));
+      return 1;
+    }
+    fds[i].fd = sims[i].handle();
+    fds[i].events = POLLIN;
+    printf("%s -> %s\n", link, sims[i].path());
+  }
+  fflush(stdout);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  while (!quit)
+  {
+    uint32_t wait = 100000;
+    for (int i = 0; i < count; ++i)
+    {
+      uint32_t w = sims[i].untilNextEvent_us();
+      if (w < wait) wait = w;
+    }
+    poll(fds, count, (wait + 999) / 1000);
+    for (int i = 0; i < count; ++i)
+      sims[i].step();
+  }
+
+  for (int i = 0; i < count; ++i)
+    printf("%s%d: %u packets in, %u bad, %u replies, %u bytes corrupted, %u dropped\n", prefix, i,
+           sims[i].packetsIn, sims[i].badIn, sims[i].packetsOut, sims[i].corrupted, sims[i].overflows);
+  return 0;
+}
@@ -57,7 +57,7 @@ void buffer_append_float32(uint8_t* buffer, float number, float scale, int32_t *
 }
 
 int8_t buffer_get_int8(const uint8_t *buffer, int32_t *index) {
-	return buffer[*index++];
+	return buffer[(*index)++];
 }
 
 int16_t buffer_get_int16(const uint8_t *buffer, int32_t *index) {
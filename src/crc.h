@@ -1,6 +1,19 @@
 #ifndef CRC_H_
 #define CRC_H_
 
+#include <stdint.h>
+
 uint16_t crc16(uint8_t *buf, uint32_t len);
 
+// compile time CRC16 (same polynomial as crc16_tab), bitwise, C++11 constexpr has to be recursive
+constexpr uint16_t crc16_const_bits(uint16_t cksum, uint8_t bits)
+{
+	return bits ? crc16_const_bits((uint16_t)((cksum & 0x8000) ? (cksum << 1) ^ 0x1021 : (cksum << 1)), bits-1) : cksum;
+}
+
+constexpr uint16_t crc16_const_byte(uint16_t cksum, uint8_t b)
+{
+	return crc16_const_bits((uint16_t)(cksum ^ (b << 8)), 8);
+}
+
 #endif /* CRC_H_ */
@@ -0,0 +1,119 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <string.h>
+#include "vescfaultlog.h"
+
+VescFaultLog::VescFaultLog(VescUartApi *vesc)
+  : vesc(vesc), head(0), stored(0), open(false), faults(0)
+{
+  for (uint8_t i = 0; i < VESC_FAULT_HISTORY; ++i)
+  {
+    slots[i].seq = 0;
+    // belongs to the next slot, so reader never takes a slot not written yet as current
+    slots[i].num = i + 1;
+  }
+  sub.cb = onFault;
+  sub.ctx = this;
+  sub.field = VALUE_FAULT;
+  sub.deadband = 0;
+  vesc->addValueSubscription(&sub);
+}
+
+void VescFaultLog::beginWrite(Slot *s)
+{
+  __atomic_store_n(&s->seq, (uint8_t)(s->seq + 1), __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void VescFaultLog::endWrite(Slot *s)
+{
+  __atomic_store_n(&s->seq, (uint8_t)(s->seq + 1), __ATOMIC_RELEASE);
+}
+
+void VescFaultLog::onFault(void *ctx, VescUartApi *vesc, uint8_t)
+{
+  VescFaultLog *self = (VescFaultLog *)ctx;
+  const ValuesData *v = &vesc->values_data;
+
+  // whatever was there before has ended
+  if (self->open)
+  {
+    Slot *last = &self->slots[(uint8_t)(self->head - 1) & (VESC_FAULT_HISTORY-1)];
+    self->beginWrite(last);
+    last->ev.clearedAt = v->rx_first_at;
+    last->ev.cleared = true;
+    self->endWrite(last);
+    self->open = false;
+  }
+  if (v->fault == FAULT_CODE_NONE) return;
+
+  Slot *s = &self->slots[self->head & (VESC_FAULT_HISTORY-1)];
+  self->beginWrite(s);
+  VescFaultEvent *ev = &s->ev;
+  s->num = self->head;
+  memset(ev, 0, sizeof(*ev));
+  ev->at = v->rx_first_at;
+  ev->data.fault = (mc_fault_code)v->fault;
+  ev->data.current = v->avg_motor_current;
+  ev->data.current_filtered = v->avg_motor_current;
+  ev->data.voltage = v->input_voltage;
+  ev->data.duty = v->duty_cycle_now;
+  ev->data.rpm = v->rpm;
+  ev->data.tacho = v->tachometer_value;
+  ev->data.temperature = v->temp_fet;
+  self->endWrite(s);
+  __atomic_store_n(&self->head, (uint8_t)(self->head + 1), __ATOMIC_RELEASE);
+  if (self->stored < VESC_FAULT_HISTORY)
+    __atomic_store_n(&self->stored, (uint8_t)(self->stored + 1), __ATOMIC_RELEASE);
+  self->open = true;
+  self->faults++;
+}
+
+uint8_t VescFaultLog::read(VescFaultEvent *out, uint8_t max) const
+{
+  uint8_t h, n;
+again:
+  // writer bumps head before stored, in this order n never counts slots newer than h
+  n = __atomic_load_n(&stored, __ATOMIC_ACQUIRE);
+  h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  if (n > max) n = max;
+  for (uint8_t i = 0; i < n; ++i)
+  {
+    const Slot *s = &slots[(uint8_t)(h - 1 - i) & (VESC_FAULT_HISTORY-1)];
+    uint8_t before, after, num;
+    do {
+      before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      num = s->num;
+      memcpy(&out[i], &s->ev, sizeof(out[i]));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    // writer wrapped around while we were copying, slot has newer event now,
+    // start over or the history would come out duplicated and out of order
+    if (num != (uint8_t)(h - 1 - i)) goto again;
+  }
+  return n;
+}
+
+mc_fault_code VescFaultLog::active() const
+{
+  VescFaultEvent ev;
+  if (!read(&ev, 1) || ev.cleared) return FAULT_CODE_NONE;
+  return ev.data.fault;
+}
@@ -0,0 +1,86 @@
+#ifndef _VESCFAULTLOG_H_
+#define _VESCFAULTLOG_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#include "vescuartapi.h"
+
+// events kept, power of two, at most 128
+#ifndef VESC_FAULT_HISTORY
+# define VESC_FAULT_HISTORY 8
+#endif
+
+struct VescFaultEvent {
+  uint32_t at;          // micros() when reply with the fault started to arrive
+  uint32_t clearedAt;   // same for the first reply without it, valid if cleared
+  bool cleared;         // false while the fault lasts
+  /* values of that reply: current and current_filtered are both avg_motor_current,
+     fields COMM_GET_VALUES does not carry are 0, with selective polling the ones
+     outside of mask keep their last value
+  */
+  fault_data data;
+};
+
+/* Fault history of one controller
+
+   values_data.fault is overwritten by every reply, so fault which comes and goes
+   between two prints is lost. Fault log subscribes to it (VescValueSubscription,
+   deadband 0) and records every change to a fault code as new event with the
+   values decoded from the same reply, change back to FAULT_CODE_NONE closes it.
+   Last VESC_FAULT_HISTORY events are kept.
+
+   Thread which calls loopstep() is the only writer. read() can be called from
+   any thread without locks, every slot is a seqlock and reader retries a slot
+   which was rewritten under its hands. When writer wrapped around onto slots
+   being read, reader starts over, so history is always in order.
+*/
+class VescFaultLog {
+  private:
+    static_assert(VESC_FAULT_HISTORY && VESC_FAULT_HISTORY <= 128 && !(VESC_FAULT_HISTORY & (VESC_FAULT_HISTORY-1)),
+                  "VESC_FAULT_HISTORY has to be power of two, at most 128");
+    struct Slot {
+      uint8_t seq;        // odd while being written
+      uint8_t num;        // head when the event was written, tells reader the slot was reused
+      VescFaultEvent ev;
+    };
+    VescUartApi *vesc;
+    VescValueSubscription sub;
+    Slot slots[VESC_FAULT_HISTORY];
+    uint8_t head;         // events written, wraps around
+    uint8_t stored;       // valid slots
+    bool open;            // newest event is not cleared yet
+
+    static void onFault(void *ctx, VescUartApi *vesc, uint8_t field);
+    void beginWrite(Slot *s);
+    void endWrite(Slot *s);
+
+  public:
+    uint32_t faults;      // all events, overwritten ones too
+
+    VescFaultLog(VescUartApi *vesc);
+    ~VescFaultLog() { vesc->removeValueSubscription(&sub); }
+
+    // copies up to max newest events to out, newest first, returns how many
+    uint8_t read(VescFaultEvent *out, uint8_t max) const;
+    // fault code of newest event if it still lasts, FAULT_CODE_NONE otherwise
+    mc_fault_code active() const;
+};
+
+#endif // _VESCFAULTLOG_H_
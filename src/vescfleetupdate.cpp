@@ -0,0 +1,235 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vescfleetupdate.h"
+
+VescFleetUpdate::VescFleetUpdate(VescUartApi *vesc)
+  : vesc(vesc), image(nullptr), imagesize(0), st(FLEET_IDLE), stepAt(0), tries(0), verifying(-1),
+    expectFw(false), expectedFw{0,0}, upload(vesc), nodeCount(0), localFw{0,0}, localVerified(false),
+    pingTimeout_us(3000000), fwTimeout_us(500000), rebootDelay_us(10000000), maxRetries(3)
+{
+  listener.cb = onPacket;
+  listener.ctx = this;
+  listener.next = nullptr;
+  upload.allCan = true;
+  // CAN forwarding is much slower than UART, don't overflow nodes with big window
+  upload.windowSize = 2;
+  upload.writeDelay_us = 2000000;
+  upload.timeout_us = 3000000;
+}
+
+void VescFleetUpdate::setExpectedFw(uint8_t major, uint8_t minor)
+{
+  expectFw = true;
+  expectedFw[0] = major;
+  expectedFw[1] = minor;
+}
+
+bool VescFleetUpdate::start(const uint8_t *image, uint32_t imagesize)
+{
+  if (st != FLEET_IDLE && st != FLEET_DONE && st != FLEET_FAILED) return false;
+  this->image = image;
+  this->imagesize = imagesize;
+  nodeCount = 0;
+  localVerified = false;
+  localFw[0] = localFw[1] = 0;
+  tries = 0;
+
+  vesc->removePacketListener(&listener);
+  vesc->addPacketListener(&listener);
+  st = FLEET_DISCOVER;
+  stepAt = micros();
+  vesc->pingCan();
+  return true;
+}
+
+void VescFleetUpdate::abort()
+{
+  upload.abort();
+  vesc->removePacketListener(&listener);
+  if (st != FLEET_IDLE && st != FLEET_DONE) st = FLEET_FAILED;
+}
+
+void VescFleetUpdate::fail()
+{
+  st = FLEET_FAILED;
+  vesc->removePacketListener(&listener);
+}
+
+void VescFleetUpdate::loopstep()
+{
+  uint32_t now = micros();
+  switch(st)
+  {
+    case FLEET_DISCOVER:
+    case FLEET_VERIFY_PING:
+      if (now - stepAt > pingTimeout_us)
+      {
+        if (++tries > maxRetries)
+        {
+          fail();
+          return;
+        }
+        stepAt = now;
+        vesc->pingCan();
+      }
+      break;
+
+    case FLEET_UPLOAD:
+      upload.loopstep();
+      if (upload.state() == VescFwUpload::FWUP_DONE)
+      {
+        vesc->jumpToBootloaderAllCan();
+        st = FLEET_REBOOT;
+        stepAt = now;
+      }
+      else if (upload.state() == VescFwUpload::FWUP_FAILED)
+        fail();
+      break;
+
+    case FLEET_REBOOT:
+      if (now - stepAt > rebootDelay_us)
+      {
+        st = FLEET_VERIFY_PING;
+        tries = 0;
+        stepAt = now;
+        vesc->pingCan();
+      }
+      break;
+
+    case FLEET_VERIFY_FW:
+      if (now - stepAt > fwTimeout_us)
+      {
+        if (++tries > maxRetries)
+        {
+          // this one is not going to answer, try the rest
+          tries = 0;
+          verifying++;
+          askNextFw();
+          return;
+        }
+        stepAt = now;
+        if (verifying < 0) vesc->askFwVersion();
+        else vesc->askFwVersionCan(nodes[verifying].canId);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void VescFleetUpdate::onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t packetsize)
+{
+  VescFleetUpdate *self = (VescFleetUpdate *)ctx;
+  switch(packet[0])
+  {
+    case COMM_PING_CAN:
+      self->rcvd_PING_CAN(packet+1, packetsize-1);
+      break;
+    case COMM_FW_VERSION:
+      self->rcvd_FW_VERSION(packet+1, packetsize-1);
+      break;
+    default:
+      break;
+  }
+}
+
+void VescFleetUpdate::rcvd_PING_CAN(const uint8_t *data, uint16_t datasize)
+{
+  if (st == FLEET_DISCOVER)
+  {
+    nodeCount = 0;
+    for (uint16_t i = 0; i < datasize && nodeCount < VESC_FLEET_MAX_NODES; ++i)
+    {
+      Node *n = &nodes[nodeCount++];
+      n->canId = data[i];
+      n->seenAfter = n->gotFw = n->verified = false;
+      n->fw[0] = n->fw[1] = 0;
+    }
+    st = FLEET_UPLOAD;
+    if (!upload.start(image, imagesize)) fail();
+  }
+  else if (st == FLEET_VERIFY_PING)
+  {
+    for (uint16_t i = 0; i < datasize; ++i)
+      for (uint8_t j = 0; j < nodeCount; ++j)
+        if (nodes[j].canId == data[i]) nodes[j].seenAfter = true;
+    st = FLEET_VERIFY_FW;
+    tries = 0;
+    verifying = -1;
+    stepAt = micros();
+    vesc->askFwVersion();
+  }
+}
+
+void VescFleetUpdate::rcvd_FW_VERSION(const uint8_t *data, uint16_t datasize)
+{
+  if (st != FLEET_VERIFY_FW || datasize < 2) return;
+  // late answer to an ask which timed out already, or not asked by us
+  if (vesc->fwVersionFrom() != (verifying < 0 ? VESC_FW_LOCAL : nodes[verifying].canId)) return;
+  if (verifying < 0)
+  {
+    localFw[0] = data[0];
+    localFw[1] = data[1];
+    localVerified = !expectFw || (localFw[0] == expectedFw[0] && localFw[1] == expectedFw[1]);
+  }
+  else
+  {
+    Node *n = &nodes[verifying];
+    n->fw[0] = data[0];
+    n->fw[1] = data[1];
+    n->gotFw = true;
+  }
+  tries = 0;
+  verifying++;
+  askNextFw();
+}
+
+void VescFleetUpdate::askNextFw()
+{
+  // skip nodes which did not come back after reboot, no point asking them
+  while (verifying < nodeCount && !nodes[verifying].seenAfter) verifying++;
+  if (verifying >= nodeCount)
+  {
+    finishVerify();
+    return;
+  }
+  stepAt = micros();
+  vesc->askFwVersionCan(nodes[verifying].canId);
+}
+
+void VescFleetUpdate::finishVerify()
+{
+  const uint8_t *want = expectFw ? expectedFw : localFw;
+  bool all = localVerified;
+  for (uint8_t i = 0; i < nodeCount; ++i)
+  {
+    Node *n = &nodes[i];
+    n->verified = n->seenAfter && n->gotFw && n->fw[0] == want[0] && n->fw[1] == want[1];
+    all = all && n->verified;
+  }
+  vesc->removePacketListener(&listener);
+  st = all ? FLEET_DONE : FLEET_FAILED;
+}
+
+uint8_t VescFleetUpdate::verifiedCount() const
+{
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < nodeCount; ++i)
+    if (nodes[i].verified) n++;
+  return n;
+}
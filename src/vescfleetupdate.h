@@ -0,0 +1,97 @@
+#ifndef _VESCFLEETUPDATE_H_
+#define _VESCFLEETUPDATE_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescuartapi.h"
+#include "vescfwupload.h"
+
+// max. CAN nodes tracked by fleet update
+#define VESC_FLEET_MAX_NODES 32
+
+/* Flash the controller on UART and all controllers on its CAN bus at once
+
+   Steps:
+   1. COMM_PING_CAN - remember which CAN nodes are there
+   2. upload firmware with *_ALL_CAN commands, every node writes the same chunks
+   3. COMM_JUMP_TO_BOOTLOADER_ALL_CAN and wait for nodes to reboot
+   4. COMM_PING_CAN again, every node seen before has to answer
+   5. COMM_FW_VERSION of local controller and of each node (COMM_FORWARD_CAN)
+
+   Node is verified, when it answered both ping and version and its firmware version
+   is the expected one (setExpectedFw()) or, if not set, the same as the local one.
+*/
+class VescFleetUpdate {
+  public:
+    enum State { FLEET_IDLE, FLEET_DISCOVER, FLEET_UPLOAD, FLEET_REBOOT, FLEET_VERIFY_PING,
+                 FLEET_VERIFY_FW, FLEET_DONE, FLEET_FAILED };
+
+    struct Node {
+      uint8_t canId;
+      bool seenAfter;    // answered ping after reboot
+      bool gotFw;
+      bool verified;
+      uint8_t fw[2];
+    };
+
+  private:
+    VescUartApi *vesc;
+    VescPacketListener listener;
+    const uint8_t *image;
+    uint32_t imagesize;
+    State st;
+    uint32_t stepAt;     // when current step (request) started
+    uint8_t tries;
+    int8_t verifying;    // node index asked for fw version, -1 for local controller
+    bool expectFw;
+    uint8_t expectedFw[2];
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    void rcvd_PING_CAN(const uint8_t *data, uint16_t datasize);
+    void rcvd_FW_VERSION(const uint8_t *data, uint16_t datasize);
+    void askNextFw();
+    void finishVerify();
+    void fail();
+
+  public:
+    VescFwUpload upload;
+    Node nodes[VESC_FLEET_MAX_NODES];
+    uint8_t nodeCount;
+    uint8_t localFw[2];
+    bool localVerified;
+
+    // tunables
+    uint32_t pingTimeout_us;   // COMM_PING_CAN pings all 254 ids, takes a while
+    uint32_t fwTimeout_us;     // not shorter than VescUartApi::fwAskTimeout_us, or answers are taken for late ones
+    uint32_t rebootDelay_us;   // bootloader flashes new firmware and reboots in this time
+    uint8_t maxRetries;        // for ping and version requests
+
+    VescFleetUpdate(VescUartApi *vesc);
+    ~VescFleetUpdate() { abort(); }
+
+    void setExpectedFw(uint8_t major, uint8_t minor);
+    bool start(const uint8_t *image, uint32_t imagesize);
+    void abort();
+    // call it after every VescUartApi::loopstep()
+    void loopstep();
+
+    State state() const { return st; }
+    uint8_t verifiedCount() const;
+};
+
+#endif // _VESCFLEETUPDATE_H_
@@ -0,0 +1,235 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vescfwupload.h"
+#include "crc.h"
+#include "buffer.h"
+
+VescFwUpload::VescFwUpload(VescUartApi *vesc)
+  : vesc(vesc), image(nullptr), imagesize(0), total(0), nextOffset(0), acked(0),
+    eraseSentAt(0), startedAt(0), finishedAt(0), st(FWUP_IDLE),
+    chunkSize(256), windowSize(4), timeout_us(1000000), eraseTimeout_us(20000000), maxRetries(5),
+    writeDelay_us(0), allCan(false), retransmits(0), nacks(0)
+{
+  listener.cb = onPacket;
+  listener.ctx = this;
+  listener.next = nullptr;
+}
+
+bool VescFwUpload::start(const uint8_t *image, uint32_t imagesize)
+{
+  if (st == FWUP_ERASING || st == FWUP_WRITING) return false;
+  if (!chunkSize || chunkSize > VESC_FWUP_MAX_CHUNK) return false;
+  if (!windowSize || windowSize > VESC_FWUP_MAX_WINDOW) return false;
+
+  this->image = image;
+  this->imagesize = imagesize;
+  int32_t i = 0;
+  buffer_append_uint32(header, imagesize, &i);
+  buffer_append_uint16(header, crc16((uint8_t *)image, imagesize), &i);
+  total = imagesize + sizeof(header);
+  nextOffset = acked = 0;
+  retransmits = nacks = 0;
+  startedAt = finishedAt = 0;
+  for (uint8_t w = 0; w < VESC_FWUP_MAX_WINDOW; ++w)
+    window[w].inflight = false;
+
+  vesc->removePacketListener(&listener);
+  vesc->addPacketListener(&listener);
+  sendErase();
+  return true;
+}
+
+void VescFwUpload::abort()
+{
+  vesc->removePacketListener(&listener);
+  if (st == FWUP_ERASING || st == FWUP_WRITING) st = FWUP_FAILED;
+}
+
+void VescFwUpload::fail()
+{
+  finishedAt = micros();
+  st = FWUP_FAILED;
+  vesc->removePacketListener(&listener);
+}
+
+void VescFwUpload::sendErase()
+{
+  int32_t index = 3;
+  frame[index++] = allCan ? COMM_ERASE_NEW_APP_ALL_CAN : COMM_ERASE_NEW_APP;
+  buffer_append_uint32(frame, total, &index);
+  vesc->sendCommandInplace(frame, 5);
+  eraseSentAt = micros();
+  st = FWUP_ERASING;
+}
+
+void VescFwUpload::sendChunk(Chunk *c)
+{
+  uint32_t len = total - c->offset;
+  if (len > chunkSize) len = chunkSize;
+
+  int32_t index = 3;
+  frame[index++] = allCan ? COMM_WRITE_NEW_APP_DATA_ALL_CAN : COMM_WRITE_NEW_APP_DATA;
+  buffer_append_uint32(frame, c->offset, &index);
+  // first bytes of the stream are size+crc header, then image itself
+  uint32_t off = c->offset;
+  uint32_t left = len;
+  for (; off < sizeof(header) && left; ++off, --left)
+    frame[index++] = header[off];
+  memcpy(frame+index, image+off-sizeof(header), left);
+
+  vesc->sendCommandInplace(frame, 5+len);
+  c->sentAt = micros();
+  c->inflight = true;
+}
+
+void VescFwUpload::loopstep()
+{
+  uint32_t now = micros();
+  if (st == FWUP_ERASING)
+  {
+    if (now - eraseSentAt > eraseTimeout_us) fail();
+    return;
+  }
+  if (st != FWUP_WRITING) return;
+  // still in writeDelay_us after erase
+  if ((int32_t)(now - startedAt) < 0) return;
+
+  for (uint8_t w = 0; w < windowSize; ++w)
+  {
+    Chunk *c = &window[w];
+    if (c->inflight)
+    {
+      if (now - c->sentAt <= timeout_us) continue;
+      // lost request or lost answer, resend just this one
+      if (++c->retries > maxRetries)
+      {
+        fail();
+        return;
+      }
+      retransmits++;
+      sendChunk(c);
+    }
+    else if (nextOffset < total)
+    {
+      c->offset = nextOffset;
+      c->retries = 0;
+      nextOffset += chunkSize;
+      if (nextOffset > total) nextOffset = total;
+      sendChunk(c);
+    }
+  }
+
+  if (nextOffset >= total && !inflight())
+  {
+    finishedAt = micros();
+    st = FWUP_DONE;
+    vesc->removePacketListener(&listener);
+  }
+}
+
+void VescFwUpload::onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t packetsize)
+{
+  VescFwUpload *self = (VescFwUpload *)ctx;
+  switch(packet[0])
+  {
+    case COMM_ERASE_NEW_APP:
+    case COMM_ERASE_NEW_APP_ALL_CAN:
+      if ((packet[0] == COMM_ERASE_NEW_APP_ALL_CAN) == self->allCan)
+        self->rcvd_ERASE_NEW_APP(packet+1, packetsize-1);
+      break;
+    case COMM_WRITE_NEW_APP_DATA:
+    case COMM_WRITE_NEW_APP_DATA_ALL_CAN:
+      if ((packet[0] == COMM_WRITE_NEW_APP_DATA_ALL_CAN) == self->allCan)
+        self->rcvd_WRITE_NEW_APP_DATA(packet+1, packetsize-1);
+      break;
+    default:
+      break;
+  }
+}
+
+void VescFwUpload::rcvd_ERASE_NEW_APP(const uint8_t *data, uint16_t datasize)
+{
+  if (st != FWUP_ERASING || datasize < 1) return;
+  if (!data[0])
+  {
+    fail();
+    return;
+  }
+  startedAt = micros() + writeDelay_us;
+  st = FWUP_WRITING;
+  loopstep();
+}
+
+void VescFwUpload::rcvd_WRITE_NEW_APP_DATA(const uint8_t *data, uint16_t datasize)
+{
+  if (st != FWUP_WRITING || datasize < 1) return;
+
+  Chunk *c = nullptr;
+  if (datasize >= 5)
+  {
+    // newer firmware echoes offset, match the exact chunk
+    int32_t i = 1;
+    uint32_t offset = buffer_get_uint32(data, &i);
+    for (uint8_t w = 0; w < windowSize; ++w)
+      if (window[w].inflight && window[w].offset == offset) { c = &window[w]; break; }
+  }
+  else
+  {
+    // older firmware does not, requests are processed in order, so it's the oldest one
+    for (uint8_t w = 0; w < windowSize; ++w)
+      if (window[w].inflight && (!c || window[w].offset < c->offset)) c = &window[w];
+  }
+  // late answer to already resent chunk
+  if (!c) return;
+
+  if (data[0])
+  {
+    uint32_t len = total - c->offset;
+    if (len > chunkSize) len = chunkSize;
+    acked += len;
+    c->inflight = false;
+  }
+  else
+  {
+    nacks++;
+    if (++c->retries > maxRetries)
+    {
+      fail();
+      return;
+    }
+    retransmits++;
+    sendChunk(c);
+  }
+}
+
+uint8_t VescFwUpload::inflight() const
+{
+  uint8_t n = 0;
+  for (uint8_t w = 0; w < windowSize; ++w)
+    if (window[w].inflight) n++;
+  return n;
+}
+
+uint32_t VescFwUpload::bytesPerSecond() const
+{
+  if (!startedAt) return 0;
+  uint32_t end = (st == FWUP_WRITING) ? micros() : finishedAt;
+  if ((int32_t)(end - startedAt) <= 0) return 0;
+  uint32_t ms = (end - startedAt) / 1000;
+  if (!ms) return 0;
+  return (uint64_t)acked * 1000 / ms;
+}
@@ -0,0 +1,107 @@
+#ifndef _VESCFWUPLOAD_H_
+#define _VESCFWUPLOAD_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescuartapi.h"
+
+// max. number of COMM_WRITE_NEW_APP_DATA requests waiting for acknowledgement
+#define VESC_FWUP_MAX_WINDOW 8
+// max. firmware bytes in one COMM_WRITE_NEW_APP_DATA frame
+#define VESC_FWUP_MAX_CHUNK 384
+
+/* Firmware upload over COMM_ERASE_NEW_APP / COMM_WRITE_NEW_APP_DATA
+
+   Image is streamed in big frames, up to windowSize of them are in flight at once.
+   Each acknowledgement is checked, failed or timed out chunk is resent alone,
+   the rest of the window continues. Image is not copied, it has to stay valid
+   (e.g. mmap-ed) until upload is finished.
+
+   Like vesc_tool, uploaded data is prefixed with 4B image size and 2B image CRC16,
+   that's what bootloader checks before it flashes the new firmware. After DONE,
+   call VescUartApi::jumpToBootloader() to actually flash it.
+
+   With allCan set, *_ALL_CAN variants are used and the controller on UART
+   forwards everything to all CAN nodes (see VescFleetUpdate).
+*/
+class VescFwUpload {
+  public:
+    enum State { FWUP_IDLE, FWUP_ERASING, FWUP_WRITING, FWUP_DONE, FWUP_FAILED };
+
+  private:
+    struct Chunk {
+      uint32_t offset;
+      uint32_t sentAt;
+      uint8_t retries;
+      bool inflight;
+    };
+
+    VescUartApi *vesc;
+    VescPacketListener listener;
+    const uint8_t *image;
+    uint32_t imagesize;
+    uint8_t header[6];
+    uint32_t total;       // header + image
+    uint32_t nextOffset;  // first byte not sent yet
+    uint32_t acked;
+    uint32_t eraseSentAt;
+    uint32_t startedAt;   // when erase finished and writing started
+    uint32_t finishedAt;
+    State st;
+    Chunk window[VESC_FWUP_MAX_WINDOW];
+    // 3B frame header, 1B command, 4B offset, data, 2B crc, 1B end
+    uint8_t frame[3 + 5 + VESC_FWUP_MAX_CHUNK + 3];
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    void rcvd_ERASE_NEW_APP(const uint8_t *data, uint16_t datasize);
+    void rcvd_WRITE_NEW_APP_DATA(const uint8_t *data, uint16_t datasize);
+    void sendErase();
+    void sendChunk(Chunk *c);
+    void fail();
+
+  public:
+    // tunables, can be changed before start()
+    uint16_t chunkSize;       // <= VESC_FWUP_MAX_CHUNK
+    uint8_t windowSize;       // <= VESC_FWUP_MAX_WINDOW
+    uint32_t timeout_us;      // resend chunk if not acknowledged in time
+    uint32_t eraseTimeout_us; // erasing flash takes a few seconds
+    uint8_t maxRetries;       // per chunk
+    uint32_t writeDelay_us;   // wait after erase is acknowledged, CAN nodes may still be erasing
+    bool allCan;              // use COMM_ERASE_NEW_APP_ALL_CAN and COMM_WRITE_NEW_APP_DATA_ALL_CAN
+
+    // statistics
+    uint32_t retransmits;
+    uint32_t nacks;
+
+    VescFwUpload(VescUartApi *vesc);
+    ~VescFwUpload() { abort(); }
+
+    bool start(const uint8_t *image, uint32_t imagesize);
+    void abort();
+    // call it after every VescUartApi::loopstep(), sends new chunks and handles timeouts
+    void loopstep();
+
+    State state() const { return st; }
+    uint32_t bytesDone() const { return acked; }
+    uint32_t bytesTotal() const { return total; }
+    uint8_t inflight() const;
+    // acknowledged bytes per second of write phase (without erase)
+    uint32_t bytesPerSecond() const;
+};
+
+#endif // _VESCFWUPLOAD_H_
@@ -0,0 +1,128 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescgroup.h"
+#include "crc.h"
+#include "datatypes.h"
+#include "buffer.h"
+
+VescSetpointGroup::VescSetpointGroup(int32_t baudrate)
+  : memberCount(0), portCount(0), usPerByte10(baudrate > 0 ? 100000000 / baudrate : 0), prepared(false),
+    broadcast(false), sends(0), issueSkew_us(0), wireSkew_us(0), maxSkew_us(0)
+{
+}
+
+bool VescSetpointGroup::add(VescUartApi *vesc, int16_t canId)
+{
+  if (memberCount >= VESC_GROUP_MAX) return false;
+  members[memberCount].vesc = vesc;
+  members[memberCount].canId = canId;
+  memberCount++;
+
+  for (uint8_t i = 0; i < portCount; ++i)
+    if (ports[i].vesc == vesc) return true;
+  ports[portCount].vesc = vesc;
+  ports[portCount].len = 0;
+  portCount++;
+  return true;
+}
+
+void VescSetpointGroup::appendFrame(Port *p, uint16_t *pos, VescUartApi *vesc, int16_t canId, uint8_t cmd, int32_t value)
+{
+  p->lastFrame = p->len;
+  if (canId < 0)
+  {
+    // local one goes through vesc's setpoint cache, so keepalive repeats the right value
+    const uint8_t *frame = vesc->setpointFrame(cmd, value);
+    memcpy(buf + *pos, frame, 10);
+    *pos += 10;
+    p->len += 10;
+    return;
+  }
+
+  uint8_t *frame = buf + *pos;
+  int32_t index = 0;
+  frame[index++] = 2;
+  frame[index++] = 7;
+  frame[index++] = COMM_FORWARD_CAN;
+  frame[index++] = (uint8_t)canId;
+  frame[index++] = cmd;
+  buffer_append_int32(frame, value, &index);
+  buffer_append_uint16(frame, crc16(frame+2, 7), &index);
+  frame[index++] = 3;
+  *pos += VESC_GROUP_FRAME;
+  p->len += VESC_GROUP_FRAME;
+}
+
+void VescSetpointGroup::prepareAll(uint8_t cmd, const int32_t *values, int32_t value)
+{
+  prepared = false;
+  if (cmd != COMM_SET_CURRENT && cmd != COMM_SET_CURRENT_BRAKE && cmd != COMM_SET_DUTY && cmd != COMM_SET_RPM)
+    return;
+
+  uint16_t pos = 0;
+  for (uint8_t i = 0; i < portCount; ++i)
+  {
+    Port *p = &ports[i];
+    p->start = pos;
+    p->len = 0;
+    p->lastFrame = 0;
+    p->local = false;
+    bool canDone = false;
+    for (uint8_t m = 0; m < memberCount; ++m)
+    {
+      Member *mb = &members[m];
+      if (mb->vesc != p->vesc) continue;
+      if (!values && broadcast && mb->canId >= 0)
+      {
+        // one forward covers all CAN nodes of this port
+        if (!canDone) appendFrame(p, &pos, p->vesc, VESC_CAN_BROADCAST, cmd, value);
+        canDone = true;
+        continue;
+      }
+      if (mb->canId < 0) p->local = true;
+      appendFrame(p, &pos, p->vesc, mb->canId, cmd, values ? values[m] : value);
+    }
+  }
+  prepared = true;
+}
+
+void VescSetpointGroup::send()
+{
+  if (!prepared) return;
+
+  uint32_t wire = 0;
+  uint32_t start = micros();
+  for (uint8_t i = 0; i < portCount; ++i)
+  {
+    Port *p = &ports[i];
+    if (!p->len) continue;
+    // CAN forwards don't reset the local controller's timeout, only its own setpoint does
+    p->vesc->sendFrames(buf + p->start, p->len, p->local);
+  }
+  uint32_t end = micros();
+
+  for (uint8_t i = 0; i < portCount; ++i)
+  {
+    uint32_t w = (uint32_t)ports[i].lastFrame * usPerByte10 / 10;
+    if (w > wire) wire = w;
+  }
+  issueSkew_us = end - start;
+  wireSkew_us = wire;
+  if (skew_us() > maxSkew_us) maxSkew_us = skew_us();
+  sends++;
+}
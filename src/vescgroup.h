@@ -0,0 +1,95 @@
+#ifndef _VESCGROUP_H_
+#define _VESCGROUP_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "vescuartapi.h"
+
+// controllers in one group
+#ifndef VESC_GROUP_MAX
+# define VESC_GROUP_MAX 8
+#endif
+// CAN id of all nodes, VESC firmware takes forwarded command for it as broadcast
+#define VESC_CAN_BROADCAST 255
+// COMM_FORWARD_CAN + id + setpoint command: 1B fmt, 1B size, 7B payload, 2B crc, 1B end
+#define VESC_GROUP_FRAME 12
+
+/* Setpoint for several controllers at once
+
+   Members are controllers on their own ports, CAN nodes behind some port, or
+   both. prepare() encodes every frame ahead of time into one buffer sorted by
+   port, send() then only hands each port its frames in a single write, back to
+   back from the calling thread. With broadcast set and one value for all, CAN
+   nodes of a port get a single forward to VESC_CAN_BROADCAST instead.
+
+   Skew is measured for each send(): issue skew is time between first and last
+   write, wire skew is how long the last frame of a port waits behind frames of
+   the same port on the line (estimated from baud rate).
+*/
+class VescSetpointGroup {
+  private:
+    struct Member {
+      VescUartApi *vesc;
+      int16_t canId;     // -1 = controller on the port itself
+    };
+    struct Port {
+      VescUartApi *vesc;
+      uint16_t start;    // frames of this port in buf
+      uint16_t len;
+      uint16_t lastFrame;  // bytes before last frame of this port
+      bool local;        // a member is the controller on the port itself
+    };
+    Member members[VESC_GROUP_MAX];
+    Port ports[VESC_GROUP_MAX];
+    uint8_t buf[VESC_GROUP_MAX * VESC_GROUP_FRAME];
+    uint8_t memberCount;
+    uint8_t portCount;
+    uint32_t usPerByte10;
+    bool prepared;
+
+    void appendFrame(Port *p, uint16_t *pos, VescUartApi *vesc, int16_t canId, uint8_t cmd, int32_t value);
+    void prepareAll(uint8_t cmd, const int32_t *values, int32_t value);
+
+  public:
+    bool broadcast;     // one CAN broadcast per port when all members get the same value
+
+    // stats of last send() and worst one so far
+    uint32_t sends;
+    uint32_t issueSkew_us;
+    uint32_t wireSkew_us;
+    uint32_t maxSkew_us;
+
+    VescSetpointGroup(int32_t baudrate);
+
+    // canId -1 is controller connected to vesc's port, false if group is full
+    bool add(VescUartApi *vesc, int16_t canId = -1);
+    uint8_t size() const { return memberCount; }
+
+    /* cmd is COMM_SET_CURRENT, _CURRENT_BRAKE, _DUTY or _RPM, values are in order
+       members were added, or one value for all of them
+    */
+    void prepare(uint8_t cmd, const int32_t *values) { prepareAll(cmd, values, 0); }
+    void prepare(uint8_t cmd, int32_t value) { prepareAll(cmd, nullptr, value); }
+    // sends what was prepared last, can be sent again
+    void send();
+
+    uint32_t skew_us() const { return issueSkew_us + wireSkew_us; }
+};
+
+#endif // _VESCGROUP_H_
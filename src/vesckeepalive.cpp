@@ -0,0 +1,80 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vesckeepalive.h"
+
+static void stopMotor(VescUartApi *vesc)
+{
+  vesc->setCurrent(0);
+}
+
+VescKeepalive::VescKeepalive(VescTimerWheel *wheel, VescUartApi *vesc)
+  : wheel(wheel), vesc(vesc), failsafeSetpointAt(0), mode(KA_ALIVE), interval_us(500000),
+    appTimeout_us(0), safeCmd(stopMotor), failsafe(false), keepalives(0), failsafes(0)
+{
+  wheel->initTimer(&timer, onTimer, this);
+}
+
+void VescKeepalive::start()
+{
+  failsafe = false;
+  rearm(micros());
+}
+
+void VescKeepalive::rearm(uint32_t now)
+{
+  // timer may fire one tick late, aim one tick earlier
+  uint32_t tick = wheel->tick_us();
+  uint32_t since = now - vesc->lastAliveTxAt;
+  uint32_t delay = since + tick < interval_us ? interval_us - tick - since : 0;
+
+  if (appTimeout_us && !failsafe && vesc->hasSetpoint())
+  {
+    since = now - vesc->lastSetpointAt;
+    uint32_t app = since < appTimeout_us ? appTimeout_us - since : 0;
+    if (app < delay) delay = app;
+  }
+  wheel->schedule(&timer, delay);
+}
+
+void VescKeepalive::onTimer(void *ctx, uint32_t now)
+{
+  VescKeepalive *ka = (VescKeepalive*)ctx;
+  VescUartApi *vesc = ka->vesc;
+
+  // application is back after failsafe
+  if (ka->failsafe && vesc->lastSetpointAt != ka->failsafeSetpointAt)
+    ka->failsafe = false;
+
+  if (ka->appTimeout_us && !ka->failsafe && vesc->hasSetpoint() &&
+      now - vesc->lastSetpointAt >= ka->appTimeout_us)
+  {
+    ka->safeCmd(vesc);
+    ka->failsafe = true;
+    ka->failsafeSetpointAt = vesc->lastSetpointAt;
+    ka->failsafes++;
+  }
+
+  if (now - vesc->lastAliveTxAt + ka->wheel->tick_us() >= ka->interval_us)
+  {
+    if (ka->mode != KA_REPEAT || !vesc->repeatSetpoint())
+      vesc->pingAmAlive();
+    ka->keepalives++;
+  }
+
+  ka->rearm(now);
+}
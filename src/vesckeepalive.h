@@ -0,0 +1,69 @@
+#ifndef _VESCKEEPALIVE_H_
+#define _VESCKEEPALIVE_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "vescuartapi.h"
+#include "vesctimerwheel.h"
+
+/* Keepalive and failsafe for one controller
+
+   VESC stops the motor when it gets no command for its timeout (app
+   configuration, 1 s by default). Keepalive makes sure something goes out
+   before that: when no setpoint or COMM_ALIVE was sent for interval_us (telemetry
+   requests don't count, they don't reset VESC timeout), it sends COMM_ALIVE or,
+   in KA_REPEAT mode, the last setpoint again.
+
+   Application has its own deadline too: if it gives no new setpoint for
+   appTimeout_us, safe command is sent (setCurrent(0) by default) once and
+   failsafe stays on until application sends another setpoint.
+
+   Nothing is polled, each keepalive is a single timer in shared VescTimerWheel,
+   armed for whichever deadline is closer.
+*/
+class VescKeepalive {
+  private:
+    VescTimerWheel *wheel;
+    VescUartApi *vesc;
+    VescTimer timer;
+    uint32_t failsafeSetpointAt;  // lastSetpointAt of the safe command
+
+    static void onTimer(void *ctx, uint32_t now);
+    void rearm(uint32_t now);
+
+  public:
+    enum Mode { KA_ALIVE, KA_REPEAT };
+    uint8_t mode;
+    uint32_t interval_us;     // longest time without resetting VESC timeout, keep it under it
+    uint32_t appTimeout_us;   // longest time without new setpoint from application, 0 = no failsafe
+    void(*safeCmd)(VescUartApi *vesc);
+    bool failsafe;            // safe command was sent, application did not send anything since
+
+    // stats
+    uint32_t keepalives;
+    uint32_t failsafes;
+
+    VescKeepalive(VescTimerWheel *wheel, VescUartApi *vesc);
+    ~VescKeepalive() { wheel->cancel(&timer); }
+
+    void start();
+    void stop() { wheel->cancel(&timer); }
+};
+
+#endif // _VESCKEEPALIVE_H_
@@ -0,0 +1,156 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescpoller.h"
+#include "datatypes.h"
+
+VescTelemetryPoller::VescTelemetryPoller(VescUartApi *vesc, int32_t baudrate, uint32_t mask)
+  : vesc(vesc), baudrate(baudrate), mask(mask), outHead(0), outCount(0), lastPoll(0), lastBackoff(0),
+    lastErrors(vesc->rxBadPackets + vesc->rxGarbage), interval(0), budgetInterval(0), minRtt(0),
+    controlShare_pct(30), maxOutstanding(2), maxInterval_us(500000), replyTimeout_us(200000),
+    lateSlack_us(2000), requests(0), replies(0), late(0), lost(0), backoffs(0), lastRtt_us(0), srtt_us(0)
+{
+  listener.cb = onPacket;
+  listener.ctx = this;
+  listener.next = nullptr;
+  vesc->addPacketListener(&listener);
+  recompute();
+}
+
+void VescTelemetryPoller::setMask(uint32_t m)
+{
+  mask = m;
+  recompute();
+}
+
+void VescTelemetryPoller::setBaudrate(int32_t b)
+{
+  baudrate = b;
+  recompute();
+}
+
+uint16_t VescTelemetryPoller::requestBytes() const
+{
+  // start, len, cmd [, mask], crc, end
+  return mask ? 10 : 6;
+}
+
+uint16_t VescTelemetryPoller::replyBytes() const
+{
+  uint16_t payload = 1;
+  for (uint8_t b = 0; b < VALUE_FIELD_COUNT; ++b)
+    if (!mask || (mask & ((uint32_t)1 << b)))
+      payload += vescValueFieldBytes[b];
+  if (mask) payload += 4;
+  // short format has 1 byte length, long one 2
+  return payload + (payload < 256 ? 5 : 6);
+}
+
+void VescTelemetryPoller::recompute()
+{
+  // request goes one way, reply the other one, the bigger of them limits the rate
+  uint32_t bytes = requestBytes();
+  if (replyBytes() > bytes) bytes = replyBytes();
+  uint8_t share = controlShare_pct < 90 ? controlShare_pct : 90;
+  uint32_t usPerByte10 = baudrate > 0 ? 100000000 / baudrate : 0;
+  budgetInterval = bytes * usPerByte10 / 10 * 100 / (100 - share);
+
+  // start carefully, replies make it faster
+  interval = budgetInterval * 4;
+  if (interval > maxInterval_us) interval = maxInterval_us;
+  minRtt = 0;
+}
+
+void VescTelemetryPoller::onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t)
+{
+  VescTelemetryPoller *p = (VescTelemetryPoller*)ctx;
+  if (packet[0] == (p->mask ? COMM_GET_VALUES_SELECTIVE : COMM_GET_VALUES))
+    p->rcvd_values();
+}
+
+void VescTelemetryPoller::backoff(uint32_t now)
+{
+  // one back off per interval is enough, the rest is usually the same congestion
+  if (now - lastBackoff < interval) return;
+  lastBackoff = now;
+  backoffs++;
+  interval *= 2;
+  if (interval > maxInterval_us) interval = maxInterval_us;
+}
+
+void VescTelemetryPoller::rcvd_values()
+{
+  // answer to request we already gave up, or someone else asked
+  if (!outCount) return;
+
+  uint32_t now = micros();
+  uint32_t rtt = now - sentAt[outHead];
+  outHead = (outHead + 1) % VESC_POLL_MAX_OUTSTANDING;
+  outCount--;
+  replies++;
+
+  lastRtt_us = rtt;
+  srtt_us = srtt_us ? (7 * srtt_us + rtt) / 8 : rtt;
+  if (!minRtt || rtt < minRtt) minRtt = rtt;
+
+  // one more reply queued in front of this one is still fine
+  if (rtt > minRtt + budgetInterval + lateSlack_us)
+  {
+    late++;
+    backoff(now);
+    return;
+  }
+
+  // on time, go faster by 1/4, from the slowest polling back to the budget takes about 2 s
+  uint32_t floor = budgetInterval;
+  if (interval - interval / 4 > floor) interval -= interval / 4;
+  else interval = floor;
+}
+
+void VescTelemetryPoller::loopstep()
+{
+  uint32_t now = micros();
+
+  uint32_t errors = vesc->rxBadPackets + vesc->rxGarbage;
+  if (errors != lastErrors)
+  {
+    lastErrors = errors;
+    backoff(now);
+  }
+
+  // drop requests without answer
+  while (outCount && now - sentAt[outHead] > replyTimeout_us)
+  {
+    outHead = (outHead + 1) % VESC_POLL_MAX_OUTSTANDING;
+    outCount--;
+    lost++;
+    backoff(now);
+  }
+
+  uint8_t window = maxOutstanding;
+  if (window > VESC_POLL_MAX_OUTSTANDING) window = VESC_POLL_MAX_OUTSTANDING;
+  if (!window) window = 1;
+  if (outCount >= window) return;
+  if (requests && now - lastPoll < interval) return;
+
+  if (mask) vesc->askValuesSelective(mask);
+  else vesc->askValues();
+  sentAt[(outHead + outCount) % VESC_POLL_MAX_OUTSTANDING] = now;
+  outCount++;
+  requests++;
+  lastPoll = now;
+}
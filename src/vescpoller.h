@@ -0,0 +1,95 @@
+#ifndef _VESCPOLLER_H_
+#define _VESCPOLLER_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "vescuartapi.h"
+
+// most requests waiting for answer at once
+#define VESC_POLL_MAX_OUTSTANDING 4
+
+/* Adaptive telemetry poller
+
+   Asks for values as often as the link allows instead of at hand tuned rate.
+   Request and reply sizes are known (reply size follows the mask), so together
+   with baud rate they give the shortest poll interval that still leaves
+   controlShare_pct of the line for setpoints and other traffic.
+
+   Actual interval is adjusted around that limit: every reply on time shortens
+   it a bit, reply coming late (round trip growing above the best one seen, i.e.
+   something queues), lost reply or new rx errors double it. So it settles near
+   what link and VESC really handle and backs off quickly when they don't.
+*/
+class VescTelemetryPoller {
+  private:
+    VescUartApi *vesc;
+    VescPacketListener listener;
+    int32_t baudrate;
+    uint32_t mask;
+    uint32_t sentAt[VESC_POLL_MAX_OUTSTANDING];  // FIFO of requests waiting for answer
+    uint8_t outHead;
+    uint8_t outCount;
+    uint32_t lastPoll;
+    uint32_t lastBackoff;
+    uint32_t lastErrors;    // rx errors of vesc seen so far
+    uint32_t interval;
+    uint32_t budgetInterval;
+    uint32_t minRtt;
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    void rcvd_values();
+    void backoff(uint32_t now);
+
+  public:
+    uint8_t controlShare_pct;   // part of link capacity kept free for other traffic
+    uint8_t maxOutstanding;     // requests in flight, up to VESC_POLL_MAX_OUTSTANDING
+    uint32_t maxInterval_us;    // slowest polling when backing off
+    uint32_t replyTimeout_us;   // answer not here after this long is lost
+    uint32_t lateSlack_us;      // round trip more than one reply time + this above the best one is late
+
+    // stats
+    uint32_t requests;
+    uint32_t replies;
+    uint32_t late;
+    uint32_t lost;
+    uint32_t backoffs;
+    uint32_t lastRtt_us;
+    uint32_t srtt_us;           // smoothed round trip
+
+    VescTelemetryPoller(VescUartApi *vesc, int32_t baudrate, uint32_t mask = 0);
+    ~VescTelemetryPoller() { vesc->removePacketListener(&listener); }
+
+    // 0 asks COMM_GET_VALUES, anything else COMM_GET_VALUES_SELECTIVE with this mask
+    void setMask(uint32_t mask);
+    void setBaudrate(int32_t baudrate);
+    // call after changing controlShare_pct, starts slow again
+    void recompute();
+    // call it after every VescUartApi::loopstep()
+    void loopstep();
+
+    uint16_t requestBytes() const;
+    uint16_t replyBytes() const;
+    // shortest interval link budget allows
+    uint32_t budgetInterval_us() const { return budgetInterval; }
+    uint32_t interval_us() const { return interval; }
+    uint32_t rateHz() const { return interval ? 1000000 / interval : 0; }
+    uint32_t getMask() const { return mask; }
+};
+
+#endif // _VESCPOLLER_H_
@@ -0,0 +1,126 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vescterminal.h"
+
+VescTerminal::VescTerminal(VescUartApi *vesc)
+  : vesc(vesc), queuelen(0), outstart(0), outlen(0), linelen(0), busy(false), gotOutput(false),
+    lastActivity(0), lineCB(nullptr), quiet_us(200000), timeout_us(2000000), sync(false), dropped(0)
+{
+  listener.cb = onPacket;
+  listener.ctx = this;
+  listener.next = nullptr;
+  vesc->addPacketListener(&listener);
+}
+
+bool VescTerminal::command(const char *cmd)
+{
+  uint16_t len = strlen(cmd);
+  if (!len || queuelen + len + 1 > VESC_TERM_QUEUE) return false;
+  memcpy(queue+queuelen, cmd, len+1);
+  queuelen += len+1;
+  loopstep();
+  return true;
+}
+
+void VescTerminal::loopstep()
+{
+  uint32_t now = micros();
+  if (busy)
+  {
+    // wait until output stops or, if there is none, until timeout
+    if (now - lastActivity < (gotOutput ? quiet_us : timeout_us)) return;
+    busy = false;
+    flushLine();
+  }
+  if (!queuelen) return;
+
+  uint8_t buf[3 + VESC_TERM_QUEUE + 3];
+  uint16_t len = strlen(queue);
+  buf[3] = sync ? COMM_TERMINAL_CMD_SYNC : COMM_TERMINAL_CMD;
+  memcpy(buf+4, queue, len);
+  vesc->sendCommandInplace(buf, len+1);
+
+  queuelen -= len+1;
+  memmove(queue, queue+len+1, queuelen);
+  busy = true;
+  gotOutput = false;
+  lastActivity = now;
+}
+
+void VescTerminal::onPacket(void *ctx, VescUartApi *, const uint8_t *packet, uint16_t packetsize)
+{
+  if (packet[0] == COMM_PRINT)
+    ((VescTerminal *)ctx)->rcvd_PRINT(packet+1, packetsize-1);
+}
+
+void VescTerminal::rcvd_PRINT(const uint8_t *data, uint16_t datasize)
+{
+  gotOutput = true;
+  lastActivity = micros();
+  for (uint16_t i = 0; i < datasize; ++i)
+  {
+    char c = data[i];
+    if (!c) break;
+    storeOutput(c);
+    if (c == '\n')
+    {
+      flushLine();
+      continue;
+    }
+    if (linelen >= VESC_TERM_LINE) flushLine();
+    line[linelen++] = c;
+  }
+  // one COMM_PRINT is one line, firmware does not send '\n'
+  if (linelen)
+  {
+    storeOutput('\n');
+    flushLine();
+  }
+}
+
+void VescTerminal::storeOutput(char c)
+{
+  if (outlen >= VESC_TERM_BUFSIZE)
+  {
+    // full, drop the oldest
+    outstart = (outstart+1) % VESC_TERM_BUFSIZE;
+    outlen--;
+    dropped++;
+  }
+  out[(outstart+outlen) % VESC_TERM_BUFSIZE] = c;
+  outlen++;
+}
+
+void VescTerminal::flushLine()
+{
+  if (!linelen) return;
+  line[linelen] = 0;
+  linelen = 0;
+  if (lineCB) lineCB(this, line);
+}
+
+uint16_t VescTerminal::read(char *dst, uint16_t maxlen)
+{
+  uint16_t n = 0;
+  for (; n < maxlen && outlen; ++n)
+  {
+    dst[n] = out[outstart];
+    outstart = (outstart+1) % VESC_TERM_BUFSIZE;
+    outlen--;
+  }
+  return n;
+}
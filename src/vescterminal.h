@@ -0,0 +1,81 @@
+#ifndef _VESCTERMINAL_H_
+#define _VESCTERMINAL_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescuartapi.h"
+
+// bytes of commands waiting to be sent, including terminating zeros
+#define VESC_TERM_QUEUE 128
+// bytes of received COMM_PRINT output kept for read(), oldest is dropped first
+#define VESC_TERM_BUFSIZE 512
+// longest line passed to line callback, longer lines are split
+#define VESC_TERM_LINE 128
+
+/* Remote VESC terminal over COMM_TERMINAL_CMD(_SYNC) / COMM_PRINT
+
+   Commands are queued and sent one at a time from loopstep(), nothing blocks,
+   so values polling can continue as usual. Firmware does not mark end of command
+   output, so next command is sent when there was no COMM_PRINT for quiet_us.
+
+   Output goes to bounded buffer (read()) and, line by line, to line callback.
+   Firmware sends one COMM_PRINT per printed line, so packet end is line end too.
+*/
+class VescTerminal {
+  private:
+    VescUartApi *vesc;
+    VescPacketListener listener;
+    char queue[VESC_TERM_QUEUE];
+    uint16_t queuelen;
+    char out[VESC_TERM_BUFSIZE];
+    uint16_t outstart;
+    uint16_t outlen;
+    char line[VESC_TERM_LINE+1];
+    uint16_t linelen;
+    bool busy;            // command sent, output may still come
+    bool gotOutput;       // any COMM_PRINT since command was sent
+    uint32_t lastActivity;  // command sent or last output received
+    void(*lineCB)(VescTerminal *, const char *);
+
+    static void onPacket(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+    void rcvd_PRINT(const uint8_t *data, uint16_t datasize);
+    void storeOutput(char c);
+    void flushLine();
+
+  public:
+    uint32_t quiet_us;    // command is finished after this long without output
+    uint32_t timeout_us;  // command without any output is finished after this long
+    bool sync;            // use COMM_TERMINAL_CMD_SYNC instead of COMM_TERMINAL_CMD
+    uint32_t dropped;     // output bytes dropped because nobody read() them in time
+
+    VescTerminal(VescUartApi *vesc);
+    ~VescTerminal() { vesc->removePacketListener(&listener); }
+
+    // queue command, false if queue is full
+    bool command(const char *cmd);
+    // call it after every VescUartApi::loopstep()
+    void loopstep();
+    // called for every complete line of output, line is zero terminated, without '\n'
+    void setLineCB(void(*cb)(VescTerminal *, const char *line)) { lineCB = cb; }
+
+    bool idle() const { return !busy && !queuelen; }
+    uint16_t available() const { return outlen; }
+    uint16_t read(char *dst, uint16_t maxlen);
+};
+
+#endif // _VESCTERMINAL_H_
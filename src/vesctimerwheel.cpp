@@ -0,0 +1,116 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vesctimerwheel.h"
+
+static_assert((VESC_WHEEL_SLOTS & (VESC_WHEEL_SLOTS - 1)) == 0 && VESC_WHEEL_SLOTS < 256,
+              "VESC_WHEEL_SLOTS must be power of two below 256");
+
+VescTimerWheel::VescTimerWheel(uint32_t tick_us)
+  : firing(nullptr), tick(tick_us ? tick_us : 1), lastTick(micros()), current(0)
+{
+  for (uint16_t i = 0; i < VESC_WHEEL_SLOTS; ++i) slots[i] = nullptr;
+}
+
+void VescTimerWheel::initTimer(VescTimer *t, void(*cb)(void *ctx, uint32_t now), void *ctx)
+{
+  t->cb = cb;
+  t->ctx = ctx;
+  t->next = t->prev = nullptr;
+  t->rounds = 0;
+  t->slot = 0;
+  t->armed = false;
+}
+
+void VescTimerWheel::link(VescTimer *t, uint8_t slot)
+{
+  t->slot = slot;
+  VescTimer **head = headOf(t);
+  t->prev = nullptr;
+  t->next = *head;
+  if (t->next) t->next->prev = t;
+  *head = t;
+}
+
+void VescTimerWheel::unlink(VescTimer *t)
+{
+  if (t->prev) t->prev->next = t->next;
+  else *headOf(t) = t->next;
+  if (t->next) t->next->prev = t->prev;
+  t->next = t->prev = nullptr;
+}
+
+void VescTimerWheel::schedule(VescTimer *t, uint32_t delay_us)
+{
+  if (t->armed) unlink(t);
+  // slots are counted from current tick, which may be a while ago
+  uint32_t ticks = (delay_us + (micros() - lastTick) + tick - 1) / tick;
+  if (!ticks) ticks = 1;
+  t->rounds = (ticks - 1) / VESC_WHEEL_SLOTS;
+  t->armed = true;
+  link(t, (current + ticks) & (VESC_WHEEL_SLOTS - 1));
+}
+
+void VescTimerWheel::cancel(VescTimer *t)
+{
+  if (!t->armed) return;
+  unlink(t);
+  t->armed = false;
+}
+
+void VescTimerWheel::fire(uint32_t now)
+{
+  // take the whole slot first, callbacks may arm timers into it again
+  firing = slots[current];
+  slots[current] = nullptr;
+  for (VescTimer *t = firing; t; t = t->next) t->slot = VESC_WHEEL_SLOTS;
+
+  while (firing)
+  {
+    VescTimer *t = firing;
+    unlink(t);
+    if (t->rounds)
+    {
+      t->rounds--;
+      link(t, current);
+      continue;
+    }
+    t->armed = false;
+    t->cb(t->ctx, now);
+  }
+}
+
+void VescTimerWheel::loopstep()
+{
+  uint32_t now = micros();
+  // after a long stall visit every slot once, timers in them are late anyway
+  if (now - lastTick > tick * VESC_WHEEL_SLOTS)
+    lastTick = now - tick * VESC_WHEEL_SLOTS;
+
+  while (now - lastTick >= tick)
+  {
+    lastTick += tick;
+    current = (current + 1) & (VESC_WHEEL_SLOTS - 1);
+    fire(now);
+  }
+}
+
+uint32_t VescTimerWheel::untilNextTick_us() const
+{
+  uint32_t elapsed = micros() - lastTick;
+  return elapsed >= tick ? 0 : tick - elapsed;
+}
@@ -0,0 +1,76 @@
+#ifndef _VESCTIMERWHEEL_H_
+#define _VESCTIMERWHEEL_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "vescuartapi.h"
+
+// slots of the wheel, power of two; timers further than slots*tick wait extra rounds
+#ifndef VESC_WHEEL_SLOTS
+# define VESC_WHEEL_SLOTS 64
+#endif
+
+// timer owned by the user, wheel only links it into its slots
+struct VescTimer {
+  void(*cb)(void *ctx, uint32_t now);
+  void *ctx;
+  VescTimer *next;
+  VescTimer *prev;
+  uint16_t rounds;   // whole wheel turns left before it expires
+  uint8_t slot;
+  bool armed;
+};
+
+/* Hashed timer wheel
+
+   Timers are kept in slots by expiry tick, so arming, cancelling and advancing
+   by one tick are O(1), no matter how many timers there are. One wheel can be
+   shared by any number of controllers, e.g. keepalives of all ports.
+
+   Timer never fires early, it fires at most one tick late.
+*/
+class VescTimerWheel {
+  private:
+    VescTimer *slots[VESC_WHEEL_SLOTS];
+    VescTimer *firing;      // timers of the slot being processed
+    uint32_t tick;
+    uint32_t lastTick;      // micros() of current slot
+    uint8_t current;
+
+    VescTimer **headOf(VescTimer *t) { return t->slot == VESC_WHEEL_SLOTS ? &firing : &slots[t->slot]; }
+    void link(VescTimer *t, uint8_t slot);
+    void unlink(VescTimer *t);
+    void fire(uint32_t now);
+
+  public:
+    VescTimerWheel(uint32_t tick_us = 10000);
+
+    void initTimer(VescTimer *t, void(*cb)(void *ctx, uint32_t now), void *ctx);
+    // (re)arm timer to fire after delay_us
+    void schedule(VescTimer *t, uint32_t delay_us);
+    void cancel(VescTimer *t);
+    // call it often, fires everything that expired since last call
+    void loopstep();
+
+    uint32_t tick_us() const { return tick; }
+    // how long caller can sleep before next loopstep() is needed
+    uint32_t untilNextTick_us() const;
+};
+
+#endif // _VESCTIMERWHEEL_H_
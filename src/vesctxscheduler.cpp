@@ -0,0 +1,224 @@
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vesctxscheduler.h"
+
+void VescTxScheduler::FrameQueue::copyIn(uint16_t pos, const uint8_t *src, uint16_t n)
+{
+  pos %= size;
+  uint16_t first = size - pos;
+  if (first > n) first = n;
+  memcpy(buf+pos, src, first);
+  memcpy(buf, src+first, n-first);
+}
+
+void VescTxScheduler::FrameQueue::copyOut(uint16_t pos, uint8_t *dst, uint16_t n) const
+{
+  pos %= size;
+  uint16_t first = size - pos;
+  if (first > n) first = n;
+  memcpy(dst, buf+pos, first);
+  memcpy(dst+first, buf, n-first);
+}
+
+bool VescTxScheduler::FrameQueue::push(const uint8_t *frame, uint16_t framelen)
+{
+  if (len + 2 + framelen > size) return false;
+  uint8_t hdr[2] = { (uint8_t)(framelen >> 8), (uint8_t)framelen };
+  copyIn(head+len, hdr, 2);
+  copyIn(head+len+2, frame, framelen);
+  len += 2 + framelen;
+  frames++;
+  return true;
+}
+
+uint16_t VescTxScheduler::FrameQueue::lengthAt(uint16_t off) const
+{
+  uint8_t hdr[2];
+  copyOut(head+off, hdr, 2);
+  return ((uint16_t)hdr[0] << 8) | hdr[1];
+}
+
+static void reverseBytes(uint8_t *p, uint16_t n)
+{
+  for (uint16_t i = 0, j = n; i + 1 < j; ++i)
+  {
+    uint8_t t = p[i];
+    p[i] = p[--j];
+    p[j] = t;
+  }
+}
+
+const uint8_t *VescTxScheduler::FrameQueue::front()
+{
+  uint16_t framelen = lengthAt(0);
+  if ((uint32_t)head + 2 + framelen > size)
+  {
+    // wraps, rotate storage left by head in place so that the queue starts at 0,
+    // frame has to go to uart in one write or it could be torn on the wire
+    reverseBytes(buf, head);
+    reverseBytes(buf+head, size-head);
+    reverseBytes(buf, size);
+    head = 0;
+  }
+  return buf + head + 2;
+}
+
+void VescTxScheduler::FrameQueue::discard(uint16_t bytes, uint8_t n)
+{
+  head = (head + bytes) % size;
+  len -= bytes;
+  frames -= n;
+}
+
+VescTxScheduler::VescTxScheduler(int32_t baudrate)
+  : uart(nullptr), usPerByte10(0), lineFreeAt(micros()), maxBlock_us(2000)
+{
+  queues[TX_CONTROL].init(qControl, sizeof(qControl));
+  queues[TX_KEEPALIVE].init(qKeepalive, sizeof(qKeepalive));
+  queues[TX_TELEMETRY].init(qTelemetry, sizeof(qTelemetry));
+  queues[TX_BULK].init(qBulk, sizeof(qBulk));
+  for (uint8_t c = 0; c < TX_CLASSES; ++c) dropped[c] = sent[c] = 0;
+  setBaudrate(baudrate);
+}
+
+void VescTxScheduler::setBaudrate(int32_t baudrate)
+{
+  // 8N1, 10 bits per byte
+  usPerByte10 = 100000000L / baudrate;
+}
+
+VescTxScheduler::Class VescTxScheduler::classify(const uint8_t *frame, uint16_t framelen)
+{
+  uint16_t payload = frame[0];  // 2 or 3 byte header
+  if (framelen <= payload) return TX_BULK;
+  uint8_t cmd = frame[payload];
+  // forwarded command has the same priority as the command itself
+  if (cmd == COMM_FORWARD_CAN && framelen > payload+2) cmd = frame[payload+2];
+
+  switch(cmd)
+  {
+    case COMM_SET_DUTY:
+    case COMM_SET_CURRENT:
+    case COMM_SET_CURRENT_BRAKE:
+    case COMM_SET_RPM:
+    case COMM_SET_POS:
+    case COMM_SET_HANDBRAKE:
+    case COMM_SET_SERVO_POS:
+    case COMM_APP_DISABLE_OUTPUT:
+      return TX_CONTROL;
+
+    case COMM_ALIVE:
+      return TX_KEEPALIVE;
+
+    case COMM_FW_VERSION:
+    case COMM_GET_VALUES:
+    case COMM_GET_VALUES_SELECTIVE:
+    case COMM_GET_VALUES_SETUP:
+    case COMM_GET_VALUES_SETUP_SELECTIVE:
+    case COMM_GET_DECODED_PPM:
+    case COMM_GET_DECODED_ADC:
+    case COMM_GET_DECODED_CHUK:
+    case COMM_GET_IMU_DATA:
+    case COMM_PING_CAN:
+    case COMM_TERMINAL_CMD:
+    case COMM_TERMINAL_CMD_SYNC:
+      return TX_TELEMETRY;
+
+    default:
+      // config, firmware upload, detection, ...
+      return TX_BULK;
+  }
+}
+
+bool VescTxScheduler::enqueue(const uint8_t *frame, uint16_t framelen)
+{
+  Class c = classify(frame, framelen);
+  if (!queues[c].push(frame, framelen))
+  {
+    dropped[c]++;
+    return false;
+  }
+  pump();
+  return true;
+}
+
+uint32_t VescTxScheduler::backlog_us(uint32_t now) const
+{
+  int32_t left = lineFreeAt - now;
+  return left > 0 ? left : 0;
+}
+
+bool VescTxScheduler::commit(const uint8_t *data, uint16_t len, uint8_t *taken, uint16_t *takenBytes)
+{
+  bool ok = uart->write(data, len) == len;
+  for (uint8_t c = 0; c < TX_CLASSES; ++c)
+  {
+    if (ok)
+    {
+      queues[c].discard(takenBytes[c], taken[c]);
+      sent[c] += taken[c];
+    }
+    else
+      dropped[c] += taken[c];
+    taken[c] = 0;
+    takenBytes[c] = 0;
+  }
+  if (ok) lineFreeAt += (uint32_t)len * usPerByte10 / 10;
+  return ok;
+}
+
+void VescTxScheduler::pump()
+{
+  uint8_t out[VESC_TXQ_WRITE];
+  uint16_t outlen = 0;
+  // frames copied to out, still in their queues until uart takes them
+  uint8_t taken[TX_CLASSES] = { 0 };
+  uint16_t takenBytes[TX_CLASSES] = { 0 };
+  uint32_t now = micros();
+  if (!backlog_us(now)) lineFreeAt = now;
+
+  for (uint8_t c = 0; c < TX_CLASSES; ++c)
+  {
+    FrameQueue *q = &queues[c];
+    while (taken[c] < q->frames)
+    {
+      // control goes always, the rest only while uart is not too busy
+      if (c != TX_CONTROL && backlog_us(now) + (uint32_t)outlen * usPerByte10 / 10 > maxBlock_us) goto done;
+
+      uint16_t framelen = q->lengthAt(takenBytes[c]);
+      if (outlen + framelen > sizeof(out))
+      {
+        if (outlen && !commit(out, outlen, taken, takenBytes)) return;
+        outlen = 0;
+      }
+      if (framelen > sizeof(out))
+      {
+        // big one, nothing else is taken now, write it on its own straight from the queue
+        taken[c] = 1;
+        takenBytes[c] = 2 + framelen;
+        if (!commit(q->front(), framelen, taken, takenBytes)) return;
+        continue;
+      }
+      q->copyOut(q->head + takenBytes[c] + 2, out+outlen, framelen);
+      outlen += framelen;
+      taken[c]++;
+      takenBytes[c] += 2 + framelen;
+    }
+  }
+done:
+  if (outlen) commit(out, outlen, taken, takenBytes);
+}
@@ -0,0 +1,108 @@
+#ifndef _VESCTXSCHEDULER_H_
+#define _VESCTXSCHEDULER_H_
+
+/*  Copyright (c) 2018 Michal Hlavinka
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "vescuartapi.h"
+
+// queue sizes in bytes, per priority class, each frame takes 2 more bytes
+#ifndef VESC_TXQ_CONTROL
+# define VESC_TXQ_CONTROL 64
+#endif
+#ifndef VESC_TXQ_KEEPALIVE
+# define VESC_TXQ_KEEPALIVE 32
+#endif
+#ifndef VESC_TXQ_TELEMETRY
+# define VESC_TXQ_TELEMETRY 128
+#endif
+// default VescFwUpload window has to fit: 4 frames of 256 B chunk, each with
+// 3B header, command and 4B offset, 3B trailer and 2B queue length
+#ifndef VESC_TXQ_BULK
+# define VESC_TXQ_BULK (4 * (3 + 5 + 256 + 3 + 2))
+#endif
+// frames are gathered up to this many bytes per uart write
+#define VESC_TXQ_WRITE 256
+
+/* Priority tx scheduler
+
+   Frames from VescUartApi are sorted into classes by command: control setpoints,
+   keepalive, telemetry requests, bulk (config, firmware, ...). Higher class always
+   goes first, within a class it's FIFO.
+
+   Frame already handed to uart can't be taken back and it can't be split on the
+   wire either, so scheduler keeps uart backlog short instead: it estimates from baud
+   rate when the line gets idle and passes lower class frames only while backlog is
+   below maxBlock_us. Control frames are passed immediately, so they wait at most
+   maxBlock_us plus one lower class frame. Bulk producers should keep their frames
+   small enough (e.g. VescFwUpload::chunkSize) for that bound to be useful, and
+   VESC_TXQ_BULK has to hold all frames they have in flight (windowSize).
+
+   Frame is taken from its queue only when uart accepted the write. Refused one stays
+   queued, pump() stops and tries it again next time.
+*/
+class VescTxScheduler {
+  public:
+    enum Class { TX_CONTROL, TX_KEEPALIVE, TX_TELEMETRY, TX_BULK, TX_CLASSES };
+
+  private:
+    // FIFO of frames, each stored as 2B length + frame bytes
+    struct FrameQueue {
+      uint8_t *buf;
+      uint16_t size;
+      uint16_t head;   // first byte of the oldest frame
+      uint16_t len;
+      uint8_t frames;
+      void init(uint8_t *b, uint16_t s) { buf = b; size = s; head = len = frames = 0; }
+      bool push(const uint8_t *frame, uint16_t framelen);
+      uint16_t lengthAt(uint16_t off) const;  // length of frame starting off bytes after head
+      const uint8_t *front();  // oldest frame in one piece, storage is rotated if it wraps
+      void discard(uint16_t bytes, uint8_t n);  // drops n oldest frames, bytes with lengths
+      void copyIn(uint16_t pos, const uint8_t *src, uint16_t n);
+      void copyOut(uint16_t pos, uint8_t *dst, uint16_t n) const;
+    };
+
+    HardwareSerial *uart;
+    uint32_t usPerByte10;   // tenths of microsecond per byte on the wire
+    uint32_t lineFreeAt;    // estimated time when uart sends everything it has
+    FrameQueue queues[TX_CLASSES];
+    uint8_t qControl[VESC_TXQ_CONTROL];
+    uint8_t qKeepalive[VESC_TXQ_KEEPALIVE];
+    uint8_t qTelemetry[VESC_TXQ_TELEMETRY];
+    uint8_t qBulk[VESC_TXQ_BULK];
+
+    uint32_t backlog_us(uint32_t now) const;
+    // writes frames taken from queues, removes them if uart accepted them
+    bool commit(const uint8_t *data, uint16_t len, uint8_t *taken, uint16_t *takenBytes);
+
+  public:
+    uint32_t maxBlock_us;            // max. uart backlog when lower class frame is passed
+    uint32_t dropped[TX_CLASSES];    // frames refused, queue full or write refused by uart (those stay queued)
+    uint32_t sent[TX_CLASSES];
+
+    VescTxScheduler(int32_t baudrate);
+
+    void attach(HardwareSerial *uart) { this->uart = uart; }
+    void setBaudrate(int32_t baudrate);
+    static Class classify(const uint8_t *frame, uint16_t framelen);
+    bool enqueue(const uint8_t *frame, uint16_t framelen);
+    // passes queued frames to uart as priorities and backlog allow, VescUartApi::loopstep() calls it
+    void pump();
+    uint16_t queued(Class c) const { return queues[c].frames; }
+};
+
+#endif // _VESCTXSCHEDULER_H_
@@ -14,10 +14,13 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
+#include <string.h>
 #include "vescuartapi.h"
 #include "crc.h"
 #include "datatypes.h"
 #include "buffer.h"
+#include "vesctxscheduler.h"
 
 // class HardwareSerial {
 //   public:
@@ -25,7 +28,7 @@
 //     int8_t read() { return 0; }
 // };
 
-int16_t VescUartApi::checkPayloadCRC(uint8_t *packet, int16_t packetsize, uint8_t *payload, int16_t payloadsize)
+int16_t VescUartApi::checkPayloadCRC(uint8_t *packet, vua_size_t packetsize, uint8_t *payload, vua_size_t payloadsize)
 {
   uint16_t expectedCRC, computedCRC;
   
@@ -38,114 +41,118 @@ int16_t VescUartApi::checkPayloadCRC(uint8_t *packet, int16_t packetsize, uint8_
   return (expectedCRC == computedCRC);
 }        
 
-bool shiftBufferToNewStart(uint8_t *buf, int16_t *buflast)
+void VescUartApi::loopstep()
 {
-  int16_t i=1;
-  for(; i<*buflast; ++i)
+  if (coalescing) flushSetpoints();
+  // lower priority frames waiting for uart backlog to go down
+  if (scheduler) scheduler->pump();
+
+#if defined(LINUXBUILD)
+  // send what is still waiting in tx queue
+  if (uart->txPending()) uart->flushTx();
+
+  // read from kernel directly into rx buffer, usually just one syscall
+  for(;;)
+  {
+    vua_size_t filled = buflast+1;
+    vua_size_t space = bufsize - filled;
+    if (!space)
+    {
+      buflast = -1;
+      continue;
+    }
+    int got = uart->readInto(buf+filled, space);
+    if (got <= 0) break;
+    buflast = filled+got-1;
+    frameBuffer(filled, uart->rxFirstAt, uart->rxLastAt);
+    // short read, port is drained
+    if (got < space) break;
+  }
+#else
+  int avail;
+  while ((avail = uart->available()) > 0)
   {
-    //find new possible packet start
-    if (buf[i] == 2 || buf[i] == 3) 
+    // take everything at once, right behind unfinished packet from last time
+    vua_size_t filled = buflast+1;
+    vua_size_t space = bufsize - filled;
+    if (!space)
     {
-      *buflast -= i;
-      memmove(buf, buf+i, *buflast);
-      return true;
+      // frameBuffer() never leaves full buffer, but anyway...
+      buflast = -1;
+      continue;
     }
+    if (avail > space) avail = space;
+    uint32_t now = micros();
+    vua_size_t fresh = filled;
+    filled += uart->readBytes(buf+filled, avail);
+    buflast = filled-1;
+    frameBuffer(fresh, now, now);
   }
-  *buflast = -1;
-  return false;
+#endif
 }
 
-void VescUartApi::loopstep()
+void VescUartApi::frameBuffer(vua_size_t fresh, uint32_t firstAt, uint32_t lastAt)
 {
-  int16_t packetsize = 0;
-  uint8_t payloadstart = 0;
-  int16_t payloadsize = 0;
-  while (uart->available())
+  vua_size_t filled = buflast+1;
+  vua_size_t start = 0;
+  if (!fresh) headAt = firstAt;
+
+  while (start < filled)
   {
-    uint8_t b = uart->read();
-    if (buflast < 0) //waiting for possible begin of a packet
+    uint8_t *p = buf+start;
+    vua_size_t avail = filled-start;
+
+    //packets can start only with 2 or 3 value, if looking for begin, throw away everything else
+    if (p[0] != 2 && p[0] != 3)
     {
-      //packets can start only with 2 or 3 value, if looking for begin, throw away everything else
-      if (b!=2 && b!=3) continue;  
-      buf[0] = b;
-      buflast = 0;
+      start++;
+      rxGarbage++;
+      continue;
     }
-    else
+
+    // for packet format, see https://github.com/vedderb/bldc/blob/master/packet.c#L45
+    // 0x02: 1B fmt, 1B size, ...., 2B CRC16, 1B end 0x03
+    // 0x03: 1B fmt, 2B size, ...., 2B CRC16, 1B end 0x03
+    vua_size_t payloadstart = p[0];
+    if (avail < payloadstart) break;
+    vua_size_t payloadsize = (p[0] == 2) ? p[1] : ((vua_size_t)p[1]<<8) + p[2];
+    vua_size_t packetsize = payloadstart + payloadsize + 3;
+
+    // as we did not do any CRC checking, size could be just a uart garbage, 
+    // don't wait for packet we can't store or which is too short to be valid
+    if (packetsize > bufsize || packetsize < MIN_RX_PACKET_SIZE)
     {
-      buf[++buflast] = b;
+      start++;
+      rxGarbage++;
+      continue;
     }
+    //wait for the rest of the packet
+    if (avail < packetsize) break;
 
-  again:
-    if (buflast >= MIN_RX_PACKET_SIZE && buflast+1 >= packetsize)
+    if (p[packetsize-1] != 3 || !checkPayloadCRC(p, packetsize, p+payloadstart, payloadsize))
     {
-      // for packet format, see https://github.com/vedderb/bldc/blob/master/packet.c#L45
-      if (buf[0] == 2)
-      {
-	payloadsize = buf[1];
-	payloadstart = 2;
-	packetsize = payloadsize + 5; // 1B fmt 0x02, 1B size, ...., 2B CRC16, 1B end 0x03
-      }
-      else if (buf[0] == 3)
-      {
-	payloadsize = buf[1]<<8;
-	payloadsize += buf[2];
-	payloadstart = 3;
-	packetsize = payloadsize + 6; // 1B fmt 0x03, 2B size, ...., 2B CRC16, 1B end 0x03
-
-	//throw away, not supported for memory reasons
-	if (packetsize > bufsize)
-	{
-	  // as we did not do any CRC checking and 0x03 2Byte size format could be just a uart garbage, 
-	  // throw away and try to find new packet, don't risk waiting for 64kB of valid packet data to be
-	  // thrown away after termination/crc check fail
-	  buflast = -1;
-	  packetsize = payloadsize = payloadstart = 0;
-	  continue;
-	}
-      }
-      else
-      {
-	// this should not happen with above checks, but anyway...
-	buflast = -1;
-	packetsize = payloadsize = payloadstart = 0;
-	continue;
-      }
-
-      if (buflast+1 >= packetsize)
-      {
-	//we have enough data to parse the packet   
-	if (buf[packetsize-1] != 3)
-	{
-	  packetsize = payloadsize = payloadstart = 0;
-	  //wrong packet termination, garbage
-	  if (shiftBufferToNewStart(buf, &buflast))
-	    goto again;
-	  //no packet begin found in buffer, search for it in future data
-	  continue;
-	}
-	if (!checkPayloadCRC(buf, packetsize, buf+payloadstart, payloadsize))
-	{
-	  // CRC check failed, garbage
-	  // and the question is: Garbage in data? crc? packet length?
-	  packetsize = payloadsize = payloadstart = 0;
-	  if (shiftBufferToNewStart(buf, &buflast))
-	    goto again;
-	  continue;
-	}
-	consumePacket(buf+payloadstart, payloadsize);
-	
-	//if there was more data in buffer than we used, shift buffer
-	if (buflast >= packetsize)
-	{
-	  memmove(buf, buf+packetsize, buflast-packetsize+1);
-	  buflast = 0;
-	}
-	else buflast = -1;
-	packetsize = payloadsize = payloadstart = 0;
-      }
+      // wrong packet termination or CRC check failed, garbage
+      // and the question is: Garbage in data? crc? packet length?
+      // so try next possible packet begin
+      start++;
+      rxBadPackets++;
+      continue;
     }
+    rxPackets++;
+    // packet which started in older read got its first byte with buf[0] at best
+    packetFirstAt = start < fresh ? headAt : firstAt;
+    packetLastAt = lastAt;
+    consumePacket(p+payloadstart, payloadsize);
+    start += packetsize;
   }
+
+  // keep unfinished packet at the beginning of the buffer
+  if (start && start < filled)
+    memmove(buf, buf+start, filled-start);
+  if (start >= fresh) headAt = firstAt;
+  buflast = filled-start-1;
 }
+
 // Added by AC to store measured values
 struct bldcMeasure {
 	//7 Values int16_t not read(14 byte)
@@ -163,11 +170,38 @@ struct bldcMeasure {
 
 void VescUartApi::rcvd_FW_VERSION(const uint8_t *data, uint16_t datasize)
 {
-  if (datasize < 2) return;
+  // asks which timed out will not be answered, or their answer came too late to tell
+  uint32_t now = micros();
+  while (fwAskCount && now - fwAsks[fwAskFirst].at > fwAskTimeout_us)
+  {
+    fwAskFirst = (fwAskFirst + 1) % VESC_FW_ASKS;
+    fwAskCount--;
+  }
+  fwFrom = VESC_FW_UNKNOWN;
+  if (fwAskCount)
+  {
+    fwFrom = fwAsks[fwAskFirst].target;
+    fwAskFirst = (fwAskFirst + 1) % VESC_FW_ASKS;
+    fwAskCount--;
+  }
+  if (datasize < 2 || fwFrom != VESC_FW_LOCAL) return;
   fw_version[0] = data[0];
   fw_version[1] = data[1];
 }
 
+void VescUartApi::pushFwAsk(int16_t target)
+{
+  // full, the oldest one is the least likely to be answered
+  if (fwAskCount == VESC_FW_ASKS)
+  {
+    fwAskFirst = (fwAskFirst + 1) % VESC_FW_ASKS;
+    fwAskCount--;
+  }
+  FwAsk *a = &fwAsks[(fwAskFirst + fwAskCount++) % VESC_FW_ASKS];
+  a->target = target;
+  a->at = micros();
+}
+
 void VescUartApi::rcvd_GET_VALUES(const uint8_t *data, uint16_t datasize, uint8_t selective)
 {
   int32_t i = 0;
@@ -242,10 +276,77 @@ void VescUartApi::rcvd_GET_VALUES(const uint8_t *data, uint16_t datasize, uint8_
     buffer_get_float16(data, 10.0, &i);
     buffer_get_float16(data, 10.0, &i);
   }
+  values_data.rx_first_at = packetFirstAt;
+  values_data.rx_last_at = packetLastAt;
  
+  if (subscriptions) notifySubscriptions(mask);
   if (getValuesCB) getValuesCB(this);
 }
 
+// same order as COMM_GET_VALUES in firmware's commands.c
+const uint8_t vescValueFieldBytes[VALUE_FIELD_COUNT] = { 2, 2, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, 4, 1, 4, 1, 6 };
+
+// where rcvd_GET_VALUES() stores each field
+enum { VT_NONE, VT_FLOAT, VT_INT32, VT_INT8 };
+struct ValueFieldInfo {
+  uint8_t offset;
+  uint8_t type;
+};
+static const ValueFieldInfo valueFields[] = {
+  { offsetof(ValuesData, temp_fet), VT_FLOAT },
+  { offsetof(ValuesData, temp_motor), VT_FLOAT },
+  { offsetof(ValuesData, avg_motor_current), VT_FLOAT },
+  { offsetof(ValuesData, avg_input_current), VT_FLOAT },
+  { 0, VT_NONE },   // id
+  { 0, VT_NONE },   // iq
+  { offsetof(ValuesData, duty_cycle_now), VT_FLOAT },
+  { offsetof(ValuesData, rpm), VT_FLOAT },
+  { offsetof(ValuesData, input_voltage), VT_FLOAT },
+  { offsetof(ValuesData, amp_hours), VT_FLOAT },
+  { offsetof(ValuesData, amp_hours_charged), VT_FLOAT },
+  { 0, VT_NONE },   // watt hours
+  { 0, VT_NONE },   // watt hours charged
+  { offsetof(ValuesData, tachometer_value), VT_INT32 },
+  { offsetof(ValuesData, tachometer_abs_value), VT_INT32 },
+  { offsetof(ValuesData, fault), VT_INT8 },
+  { offsetof(ValuesData, pid_pos), VT_FLOAT },
+  { offsetof(ValuesData, controller_id), VT_INT8 },
+  { 0, VT_NONE },   // mosfet temperatures
+};
+
+void VescUartApi::notifySubscriptions(uint32_t mask)
+{
+  const uint8_t *v = (const uint8_t *)&values_data;
+  // callback may unsubscribe itself, so next is read before it runs
+  for (VescValueSubscription *s = subscriptions, *next; s; s = next)
+  {
+    next = s->next;
+    if (!((mask >> s->field) & 1)) continue;
+    const ValueFieldInfo *fi = &valueFields[s->field];
+    float d;
+    int32_t cur;
+    if (fi->type == VT_FLOAT)
+    {
+      memcpy(&cur, v + fi->offset, sizeof(cur));
+      float f;
+      memcpy(&f, &cur, sizeof(f));
+      d = f - s->last.f;
+    }
+    else
+    {
+      if (fi->type == VT_INT32) memcpy(&cur, v + fi->offset, sizeof(cur));
+      else cur = (int8_t)v[fi->offset];
+      // wraps like the counter itself
+      d = (float)(int32_t)((uint32_t)cur - (uint32_t)s->last.i);
+    }
+    // both directions and first value in one test, without branches
+    if (!((d > s->deadband) | (-d > s->deadband) | !s->reported)) continue;
+    s->last.i = cur;
+    s->reported = true;
+    s->cb(s->ctx, this, s->field);
+  }
+}
+
 void VescUartApi::consumePacket(const uint8_t *packet, uint16_t packetsize)
 {
   COMM_PACKET_ID packetType = (COMM_PACKET_ID)packet[0];
@@ -274,62 +375,205 @@ void VescUartApi::consumePacket(const uint8_t *packet, uint16_t packetsize)
       break;
   }
   
-  
+  // pass it to registered listeners too, with packet type byte included
+  // next is taken before the call, a listener may remove itself from cb
+  for (VescPacketListener *l = listeners, *next; l; l = next)
+  {
+    next = l->next;
+    l->cb(l->ctx, this, packet-1, packetsize+1);
+  }
 }
 
+// commands without arguments are precomputed, see VescConstFrame
 void VescUartApi::askValues()
 {
-  uint8_t buf[7];
-  buf[3] = COMM_GET_VALUES;
-  sendCommandInplace(buf, 1);
+  transmit(VescConstFrame<COMM_GET_VALUES>::data, 6);
+}
+
+void VescUartApi::askValuesSelective(uint32_t mask)
+{
+  int32_t index = 3;
+  uint8_t buf[11];
+
+  buf[index++] = COMM_GET_VALUES_SELECTIVE;
+  buffer_append_uint32(buf, mask, &index);
+  sendCommandInplace(buf, 5);
 }
 
 void VescUartApi::askFwVersion()
 {
-  uint8_t buf[7];
-  buf[3] = COMM_FW_VERSION;
-  sendCommandInplace(buf, 1);
+  pushFwAsk(VESC_FW_LOCAL);
+  transmit(VescConstFrame<COMM_FW_VERSION>::data, 6);
 }
 
-void VescUartApi::setCurrent(int32_t miliamps)
+void VescUartApi::pingAmAlive()
 {
-  int32_t index = 3;
-  uint8_t buf[11];
+  lastAliveTxAt = micros();
+  transmit(VescConstFrame<COMM_ALIVE>::data, 6);
+}
 
-  buf[index++] = COMM_SET_CURRENT;
-  buffer_append_int32(buf, miliamps, &index);
-  sendCommandInplace(buf, 5);
+void VescUartApi::askFwVersionCan(uint8_t canId)
+{
+  uint8_t buf[9];
+  buf[3] = COMM_FORWARD_CAN;
+  buf[4] = canId;
+  buf[5] = COMM_FW_VERSION;
+  pushFwAsk(canId);
+  sendCommandInplace(buf, 3);
 }
 
-void VescUartApi::setCurrentBrake(int32_t miliamps)
+void VescUartApi::pingCan()
 {
-  int32_t index = 3;
-  uint8_t buf[11];
+  transmit(VescConstFrame<COMM_PING_CAN>::data, 6);
+}
 
-  buf[index++] = COMM_SET_CURRENT_BRAKE;
-  buffer_append_int32(buf, miliamps, &index);
-  sendCommandInplace(buf, 5);
+void VescUartApi::jumpToBootloader()
+{
+  transmit(VescConstFrame<COMM_JUMP_TO_BOOTLOADER>::data, 6);
+}
+
+void VescUartApi::jumpToBootloaderAllCan()
+{
+  transmit(VescConstFrame<COMM_JUMP_TO_BOOTLOADER_ALL_CAN>::data, 6);
+}
+
+VescUartApi::SetpointFrame *VescUartApi::encodeSetpoint(uint8_t slot, uint8_t cmd, int32_t value)
+{
+  SetpointFrame *sp = &setpointCache[slot];
+  if (!sp->valid || sp->value != value)
+  {
+    int32_t index = 0;
+    sp->frame[index++] = 2;
+    sp->frame[index++] = 5;
+    sp->frame[index++] = cmd;
+    buffer_append_int32(sp->frame, value, &index);
+    buffer_append_uint16(sp->frame, crc16(sp->frame+2, 5), &index);
+    sp->frame[index++] = 3;
+    sp->value = value;
+    sp->valid = true;
+  }
+  lastSetpoint = slot;
+  return sp;
+}
+
+void VescUartApi::sendSetpoint(uint8_t slot, uint8_t cmd, int32_t value)
+{
+  SetpointFrame *sp = encodeSetpoint(slot, cmd, value);
+  lastSetpointAt = micros();
+  if (!coalescing)
+  {
+    sp->sentValue = value;
+    lastSentSlot = slot;
+    lastAliveTxAt = lastSetpointAt;
+    transmit(sp->frame, sizeof(sp->frame));
+    return;
+  }
+
+  // last write wins
+  if (sp->pending) setpointsCoalesced++;
+  else
+  {
+    bool any = false;
+    for (uint8_t i = 0; i < SP_COUNT; ++i) any |= setpointCache[i].pending;
+    if (!any) pendingSince = lastSetpointAt;
+  }
+  sp->pending = true;
+  sp->seq = ++setpointSeq;
+  if (!coalesceWindow_us) flushSetpoints();
+}
+
+void VescUartApi::setCoalescing(bool on, uint32_t window_us, uint32_t resend)
+{
+  if (!on) flushSetpoints(true);
+  coalesceWindow_us = window_us;
+  resend_us = resend;
+  coalescing = on;
+}
+
+void VescUartApi::flushSetpoints(bool force)
+{
+  if (!coalescing) return;
+  uint32_t now = micros();
+  if (!force && now - pendingSince < coalesceWindow_us) return;
+
+  while (true)
+  {
+    // oldest pending first, so the last written command is the last one VESC gets
+    int8_t slot = -1;
+    for (uint8_t i = 0; i < SP_COUNT; ++i)
+    {
+      SetpointFrame *c = &setpointCache[i];
+      if (c->pending && (slot < 0 || (int8_t)(c->seq - setpointCache[slot].seq) < 0)) slot = i;
+    }
+    if (slot < 0) break;
+    SetpointFrame *sp = &setpointCache[slot];
+    sp->pending = false;
+
+    // VESC runs this command with this value already, unless other command or its timeout came since
+    if (lastSentSlot == slot && sp->sentValue == sp->value && now - lastAliveTxAt < resend_us)
+    {
+      setpointsSuppressed++;
+      continue;
+    }
+    sp->sentValue = sp->value;
+    lastSentSlot = slot;
+    lastAliveTxAt = now;
+    transmit(sp->frame, sizeof(sp->frame));
+  }
+}
+
+const uint8_t *VescUartApi::setpointFrame(uint8_t cmd, int32_t value)
+{
+  switch (cmd)
+  {
+    case COMM_SET_CURRENT: return encodeSetpoint(SP_CURRENT, cmd, value)->frame;
+    case COMM_SET_CURRENT_BRAKE: return encodeSetpoint(SP_CURRENT_BRAKE, cmd, value)->frame;
+    case COMM_SET_DUTY: return encodeSetpoint(SP_DUTY, cmd, value)->frame;
+    case COMM_SET_RPM: return encodeSetpoint(SP_RPM, cmd, value)->frame;
+    default: return nullptr;
+  }
+}
+
+void VescUartApi::sendFrames(const uint8_t *frames, vua_size_t len, bool setpoint)
+{
+  if (setpoint)
+  {
+    lastSetpointAt = lastAliveTxAt = micros();
+    // frames of any command, VESC's mode is not known now
+    lastSentSlot = -1;
+  }
+  transmit(frames, len);
+}
+
+bool VescUartApi::repeatSetpoint()
+{
+  if (lastSetpoint < 0) return false;
+  lastAliveTxAt = micros();
+  setpointCache[lastSetpoint].sentValue = setpointCache[lastSetpoint].value;
+  lastSentSlot = lastSetpoint;
+  transmit(setpointCache[lastSetpoint].frame, sizeof(setpointCache[lastSetpoint].frame));
+  return true;
+}
+
+void VescUartApi::setCurrent(int32_t miliamps)
+{
+  sendSetpoint(SP_CURRENT, COMM_SET_CURRENT, miliamps);
+}
+
+void VescUartApi::setCurrentBrake(int32_t miliamps)
+{
+  sendSetpoint(SP_CURRENT_BRAKE, COMM_SET_CURRENT_BRAKE, miliamps);
 }
 
 // -1 .. 1 mapped to -100 000 .. 100 000
 void VescUartApi::setDuty(int32_t duty)
 {
-  int32_t index = 3;
-  uint8_t buf[11];
-
-  buf[index++] = COMM_SET_DUTY;
-  buffer_append_int32(buf, duty, &index);
-  sendCommandInplace(buf, 5);
+  sendSetpoint(SP_DUTY, COMM_SET_DUTY, duty);
 }
 
 void VescUartApi::setRPM(int32_t rpm)
 {
-  int32_t index = 3;
-  uint8_t buf[11];
-
-  buf[index++] = COMM_SET_RPM;
-  buffer_append_int32(buf, rpm, &index);
-  sendCommandInplace(buf, 5);
+  sendSetpoint(SP_RPM, COMM_SET_RPM, rpm);
 }
 
 
@@ -337,22 +581,15 @@ int16_t VescUartApi::sendCommand(uint8_t *cmd, int16_t cmdlen)
 {
 	uint8_t packet[256];
 	int16_t packetlen = 0;
+
+	// 2B header, 2B crc and end byte have to fit too, longer commands go through sendCommandInplace()
+	if (cmdlen < 0 || cmdlen + 5 > (int16_t)sizeof(packet))
+		return -1;
 	uint16_t crc = crc16(cmd, cmdlen);
 
-	if (cmdlen <= 256)
-	{
-		packet[0] = 2;
-		packet[1] = cmdlen;
-		packetlen = 2;
-	}
-	else
-	{
-		// FIXME: not supported
-		packet[0] = 3;
-		packet[1] = (uint8_t)(cmdlen >> 8);
-		packet[2] = (uint8_t)(cmdlen & 0xFF);
-		packetlen = 3;
-	}
+	packet[0] = 2;
+	packet[1] = cmdlen;
+	packetlen = 2;
 	memcpy(packet+packetlen, cmd, cmdlen);
 
 	packetlen += cmdlen;
@@ -360,7 +597,7 @@ int16_t VescUartApi::sendCommand(uint8_t *cmd, int16_t cmdlen)
 	packet[packetlen++] = (uint8_t)(crc & 0xFF);
 	packet[packetlen++] = 3;
 
-	uart->write(packet, packetlen);
+	transmit(packet, packetlen);
 
 	return packetlen;
 }
@@ -374,7 +611,7 @@ int16_t VescUartApi::sendCommandInplace(uint8_t *buf, int16_t cmdlen)
 	int16_t packetlen = 0;
 	uint16_t crc = crc16(buf+3, cmdlen);
 
-	if (cmdlen <= 256)
+	if (cmdlen < 256)
 	{
 		packet = buf+1;
 		packet[0] = 2;
@@ -395,7 +632,7 @@ int16_t VescUartApi::sendCommandInplace(uint8_t *buf, int16_t cmdlen)
 	packet[packetlen++] = (uint8_t)(crc & 0xFF);
 	packet[packetlen++] = 3;
 
-	uart->write(packet, packetlen);
+	transmit(packet, packetlen);
 
 	return packetlen;
 }
@@ -413,3 +650,96 @@ void VescUartApi::setRxDataCB(COMM_PACKET_ID packet_id, void(*cb)(VescUartApi *)
       break;
   }
 }
+
+void VescUartApi::transmit(const uint8_t *packet, vua_size_t packetlen)
+{
+  // scheduler decides the order and it gathers frames itself
+  if (scheduler)
+  {
+    scheduler->enqueue(packet, packetlen);
+    return;
+  }
+  if (!txbatch)
+  {
+    uart->write(packet, packetlen);
+    return;
+  }
+  if (txbatchlen + packetlen > txbatchsize)
+  {
+    // send what we have, if it still does not fit, send it alone
+    if (txbatchlen) uart->write(txbatch, txbatchlen);
+    txbatchlen = 0;
+    if (packetlen > txbatchsize)
+    {
+      uart->write(packet, packetlen);
+      return;
+    }
+  }
+  memcpy(txbatch+txbatchlen, packet, packetlen);
+  txbatchlen += packetlen;
+}
+
+void VescUartApi::setTxScheduler(VescTxScheduler *sched)
+{
+  scheduler = sched;
+  if (sched) sched->attach(uart);
+}
+
+void VescUartApi::beginBatch(uint8_t *buf, vua_size_t bufsize)
+{
+  endBatch();
+  txbatch = buf;
+  txbatchsize = bufsize;
+  txbatchlen = 0;
+}
+
+vua_size_t VescUartApi::endBatch()
+{
+  vua_size_t len = txbatchlen;
+  if (len) uart->write(txbatch, len);
+  txbatch = nullptr;
+  txbatchlen = 0;
+  return len;
+}
+
+void VescUartApi::addPacketListener(VescPacketListener *listener)
+{
+  listener->next = listeners;
+  listeners = listener;
+}
+
+bool VescUartApi::addValueSubscription(VescValueSubscription *sub)
+{
+  if (sub->field >= sizeof(valueFields)/sizeof(valueFields[0]) || valueFields[sub->field].type == VT_NONE)
+    return false;
+  sub->reported = false;
+  sub->next = subscriptions;
+  subscriptions = sub;
+  return true;
+}
+
+void VescUartApi::removeValueSubscription(VescValueSubscription *sub)
+{
+  for (VescValueSubscription **s = &subscriptions; *s; s = &(*s)->next)
+  {
+    if (*s == sub)
+    {
+      *s = sub->next;
+      sub->next = nullptr;
+      return;
+    }
+  }
+}
+
+void VescUartApi::removePacketListener(VescPacketListener *listener)
+{
+  for (VescPacketListener **l = &listeners; *l; l = &(*l)->next)
+  {
+    if (*l == listener)
+    {
+      *l = listener->next;
+      listener->next = nullptr;
+      return;
+    }
+  }
+}
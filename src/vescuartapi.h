@@ -40,11 +40,74 @@
 
 
 #include "datatypes.h"
+#include "crc.h"
 //#include <cstddef>
 
 const int8_t MIN_RX_PACKET_SIZE = 6; // 1B fmt, 1B size, 1B payload, 2B crc, 1B end
 
+// COMM_FW_VERSION requests remembered until answered, see VescUartApi::fwVersionFrom()
+#define VESC_FW_ASKS 4
+// fwVersionFrom() values other than CAN id
+const int16_t VESC_FW_LOCAL = -1;    // controller on uart
+const int16_t VESC_FW_UNKNOWN = -2;  // nothing was asked, or all asks timed out
+
+// rx buffer sizes and positions, 16bit is enough on AVR and it's much cheaper there,
+// elsewhere allow buffers for the biggest 0x03 packets (64 kB payload)
+#if defined(__AVR__)
+typedef int16_t vua_size_t;
+#else
+typedef int32_t vua_size_t;
+#endif
+
 class HardwareSerial;
+class VescUartApi;
+class VescTxScheduler;
+
+// complete frame of command without arguments, built at compile time
+template <uint8_t Cmd>
+struct VescConstFrame {
+  static const uint8_t data[6];
+};
+template <uint8_t Cmd>
+const uint8_t VescConstFrame<Cmd>::data[6] = { 2, 1, Cmd, (uint8_t)(crc16_const_byte(0, Cmd) >> 8),
+                                               (uint8_t)crc16_const_byte(0, Cmd), 3 };
+
+// Additional consumer of received packets. Modules that talk their own sub-protocol
+// (firmware upload, ...) register one of these and get every valid packet after
+// VescUartApi processed it. packet[0] is COMM_PACKET_ID.
+struct VescPacketListener {
+  void(*cb)(void *ctx, VescUartApi *vesc, const uint8_t *packet, uint16_t packetsize);
+  void *ctx;
+  VescPacketListener *next;
+};
+
+// fields of COMM_GET_VALUES, also bit numbers in COMM_GET_VALUES_SELECTIVE mask
+enum VescValueField {
+  VALUE_TEMP_FET, VALUE_TEMP_MOTOR, VALUE_MOTOR_CURRENT, VALUE_INPUT_CURRENT, VALUE_ID, VALUE_IQ,
+  VALUE_DUTY, VALUE_RPM, VALUE_INPUT_VOLTAGE, VALUE_AMP_HOURS, VALUE_AMP_HOURS_CHARGED,
+  VALUE_WATT_HOURS, VALUE_WATT_HOURS_CHARGED, VALUE_TACHOMETER, VALUE_TACHOMETER_ABS,
+  VALUE_FAULT, VALUE_PID_POS, VALUE_CONTROLLER_ID, VALUE_TEMP_MOS,
+  VALUE_FIELD_COUNT
+};
+// bytes of each field on the wire, by VescValueField
+extern const uint8_t vescValueFieldBytes[VALUE_FIELD_COUNT];
+
+/* Change subscription of one values_data field. cb is called from rcvd_GET_VALUES()
+   when the field differs by more than deadband from the value last reported to this
+   subscription, and for the first value. Deadband 0 reports any change, it's in
+   values_data units (V, A, ...), integer fields compare exactly.
+   Only fields stored in ValuesData can be subscribed.
+*/
+struct VescValueSubscription {
+  void(*cb)(void *ctx, VescUartApi *vesc, uint8_t field);
+  void *ctx;
+  uint8_t field;    // VescValueField
+  float deadband;
+  // internal
+  union { float f; int32_t i; } last;
+  bool reported;
+  VescValueSubscription *next;
+};
 
 struct ValuesData {
   float temp_fet;
@@ -63,44 +126,179 @@ struct ValuesData {
   int8_t fault;
   float pid_pos;
   int8_t controller_id;
+  // micros() when first and last byte of the reply arrived, see VescUartApi::packetFirstAt
+  uint32_t rx_first_at;
+  uint32_t rx_last_at;
 };
 
 class VescUartApi {
   private:
     uint8_t *buf;
-    const int16_t bufsize;
+    const vua_size_t bufsize;
     HardwareSerial *uart;
-    int16_t buflast;   // last valid byte or -1 if buffer empty
+    vua_size_t buflast;   // last valid byte or -1 if buffer empty
     void(*getValuesCB)(VescUartApi *);
+    VescPacketListener *listeners;
+    VescValueSubscription *subscriptions;
+    /* COMM_FW_VERSION asks waiting for answer, oldest first. Answer does not say
+       who sent it, but VESC answers in order, so it belongs to the oldest ask
+       which has not timed out yet.
+    */
+    struct FwAsk {
+      int16_t target;  // CAN id or VESC_FW_LOCAL
+      uint32_t at;
+    };
+    FwAsk fwAsks[VESC_FW_ASKS];
+    uint8_t fwAskFirst;
+    uint8_t fwAskCount;
+    int16_t fwFrom;
+    uint8_t *txbatch;  // frames collected between beginBatch() and endBatch(), nullptr if not batching
+    vua_size_t txbatchsize;
+    vua_size_t txbatchlen;
+    VescTxScheduler *scheduler;
+
+    // last frame of each setpoint command, same value is sent again without encoding and CRC
+    enum { SP_CURRENT, SP_CURRENT_BRAKE, SP_DUTY, SP_RPM, SP_COUNT };
+    struct SetpointFrame {
+      int32_t value;
+      bool valid;
+      uint8_t frame[10];  // 1B fmt, 1B size, 1B command, 4B value, 2B crc, 1B end
+      // setpoint coalescing
+      int32_t sentValue;  // valid while lastSentSlot is this one
+      bool pending;       // written, waiting for end of coalescing window
+      uint8_t seq;        // order of writes, pending ones go out in it
+    };
+    SetpointFrame setpointCache[SP_COUNT];
+    int8_t lastSetpoint;  // slot of last setpoint command, -1 if none yet
+    int8_t lastSentSlot;  // slot of last setpoint frame VESC got, -1 if none or not known
+    bool coalescing;
+    uint8_t setpointSeq;
+    uint32_t pendingSince;  // first pending write of current window
+    uint32_t headAt;        // arrival of buf[0], kept with unfinished packet between reads
     
+    // finds and consumes all complete packets in buf, bytes from fresh on arrived firstAt..lastAt
+    void frameBuffer(vua_size_t fresh, uint32_t firstAt, uint32_t lastAt);
+    void transmit(const uint8_t *packet, vua_size_t packetlen);
+    void sendSetpoint(uint8_t slot, uint8_t cmd, int32_t value);
+    SetpointFrame *encodeSetpoint(uint8_t slot, uint8_t cmd, int32_t value);
     void rcvd_GET_VALUES(const uint8_t *data, uint16_t packetsize, uint8_t selective);
+    void notifySubscriptions(uint32_t mask);
     void rcvd_FW_VERSION(const uint8_t *data, uint16_t packetsize);
-    int16_t sendCommandInplace(uint8_t *buf, int16_t cmdlen);
+    void pushFwAsk(int16_t target);
     
   public:
     ValuesData values_data;
     uint8_t fw_version[2];
-    VescUartApi(uint8_t *buf, const int bufsize, HardwareSerial *uart) : buf(buf), bufsize(bufsize), uart(uart), buflast(-1), getValuesCB(nullptr), fw_version{0,0}
+    // rx statistics
+    uint32_t rxPackets;
+    uint32_t rxBadPackets;  // wrong termination or CRC
+    uint32_t rxGarbage;     // bytes thrown away while looking for packet begin
+    /* micros() when first and last byte of current packet arrived, valid in packet
+       listeners and callbacks. It's time of the read which got them (on Linux
+       with rx thread, time the thread read them), so resolution is one read.
+    */
+    uint32_t packetFirstAt;
+    uint32_t packetLastAt;
+    // micros() of last frame which resets VESC's command timeout (setpoint or COMM_ALIVE),
+    // and of last setpoint command given by application
+    uint32_t lastAliveTxAt;
+    uint32_t lastSetpointAt;
+    // setpoint coalescing, see setCoalescing()
+    uint32_t coalesceWindow_us;
+    uint32_t resend_us;
+    uint32_t setpointsCoalesced;  // overwritten by newer value before they were sent
+    uint32_t setpointsSuppressed; // not sent, same value was sent recently
+    // COMM_FW_VERSION not answered in this time is given up, later answer is not ours
+    uint32_t fwAskTimeout_us;
+    VescUartApi(uint8_t *buf, const vua_size_t bufsize, HardwareSerial *uart) : buf(buf), bufsize(bufsize), uart(uart), buflast(-1), getValuesCB(nullptr), listeners(nullptr), subscriptions(nullptr), fwAskFirst(0), fwAskCount(0), fwFrom(VESC_FW_UNKNOWN),
+      txbatch(nullptr), txbatchsize(0), txbatchlen(0), scheduler(nullptr), lastSetpoint(-1), lastSentSlot(-1), coalescing(false),
+      setpointSeq(0), pendingSince(0), headAt(0), fw_version{0,0},
+      rxPackets(0), rxBadPackets(0), rxGarbage(0), packetFirstAt(0), packetLastAt(0), lastAliveTxAt(0), lastSetpointAt(0),
+      coalesceWindow_us(0), resend_us(0), setpointsCoalesced(0), setpointsSuppressed(0), fwAskTimeout_us(500000)
     {
-      
+      for (uint8_t i = 0; i < SP_COUNT; ++i)
+        setpointCache[i].valid = setpointCache[i].pending = false;
     }
     void begin(int32_t baudrate) { uart->begin(baudrate); }
-    int16_t checkPayloadCRC(uint8_t *packet, int16_t packetsize, uint8_t *payload, int16_t payloadsize);
+    int16_t checkPayloadCRC(uint8_t *packet, vua_size_t packetsize, uint8_t *payload, vua_size_t payloadsize);
     void loopstep();
     void consumePacket(const uint8_t *packet, uint16_t packetsize);
     void setRxDataCB(COMM_PACKET_ID packet_id, void(*cb)(VescUartApi *));
+    void addPacketListener(VescPacketListener *listener);
+    void removePacketListener(VescPacketListener *listener);
+    // false if field is not stored in values_data
+    bool addValueSubscription(VescValueSubscription *sub);
+    void removeValueSubscription(VescValueSubscription *sub);
+    // copies command to a frame on stack, up to 251 B, -1 if longer
     int16_t sendCommand(uint8_t *cmd, int16_t cmdlen);
+    // buf must have 3 free bytes before and 3 free bytes after cmdlen bytes of command payload
+    int16_t sendCommandInplace(uint8_t *buf, int16_t cmdlen);
+    /* Commands sent between beginBatch() and endBatch() are only framed into buf,
+       endBatch() then hands them to uart in one write. Frame which does not fit
+       sends what is already collected first. See VescBatch below.
+    */
+    void beginBatch(uint8_t *buf, vua_size_t bufsize);
+    vua_size_t endBatch();
+    // all frames go through priority scheduler, nullptr to write them directly again
+    void setTxScheduler(VescTxScheduler *sched);
     void askValues();
+    void askValuesSelective(uint32_t mask); //COMM_GET_VALUES_SELECTIVE, only fields with bit set in mask
     void askFwVersion(); //COMM_FW_VERSION
+    void askFwVersionCan(uint8_t canId); //COMM_FW_VERSION forwarded to CAN node, answer goes to listeners only
+    // who sent COMM_FW_VERSION answer being passed to listeners: CAN id, VESC_FW_LOCAL or VESC_FW_UNKNOWN
+    int16_t fwVersionFrom() const { return fwFrom; }
+    void pingCan(); //COMM_PING_CAN, answer is a list of CAN ids, goes to listeners
     void pingAmAlive();//COMM_ALIVE
     void setCurrent(int32_t miliamps);
     void setCurrentBrake(int32_t miliamps);
     void setDuty(int32_t duty); //uses [-1e5, 1e5] interval for value
     void setRPM(int32_t rpm);
+    // send last setpoint command again, e.g. as keepalive, false if there was none yet
+    bool repeatSetpoint();
+    bool hasSetpoint() const { return lastSetpoint >= 0; }
+    /* Encodes setpoint command (COMM_SET_CURRENT, _CURRENT_BRAKE, _DUTY, _RPM) without
+       sending it, e.g. to send frames of several controllers at once with sendFrames().
+       Frame is 10 B, valid until next setpoint of the same command, nullptr for other commands.
+    */
+    const uint8_t *setpointFrame(uint8_t cmd, int32_t value);
+    // hands already encoded frames over in one write, setpoint = true counts them as new setpoint
+    void sendFrames(const uint8_t *frames, vua_size_t len, bool setpoint = false);
+    /* Setpoint coalescing, off by default. Setpoints are held for window_us after the
+       first one, only the last value of each command is sent then, in order they were
+       written. Command and value same as the last sent setpoint are not sent again,
+       unless nothing reset VESC's timeout for resend_us. window_us 0 keeps only the
+       suppression. Pending setpoints go out from loopstep() or flushSetpoints(),
+       force sends them before the window ends. Turning coalescing off sends them too.
+    */
+    void setCoalescing(bool on, uint32_t window_us = 0, uint32_t resend_us = 250000);
+    void flushSetpoints(bool force = false);
+    void jumpToBootloader(); //COMM_JUMP_TO_BOOTLOADER, starts the uploaded firmware
+    void jumpToBootloaderAllCan(); //COMM_JUMP_TO_BOOTLOADER_ALL_CAN, same for this and all CAN nodes
     //void setPod(int32_t pos); 1e6
     //void setHandbrake(float hb); // 1e3
     //void getDecodedPPM();
     //void getDecodedADC();
 };
 
+// VescUartApi with its own rx buffer of RxBytes, no need to pass buffer around
+template <vua_size_t RxBytes>
+class VescUartApiStatic : public VescUartApi {
+  static_assert(RxBytes >= MIN_RX_PACKET_SIZE, "rx buffer can't hold even the smallest packet");
+  private:
+    uint8_t rxbuf[RxBytes];
+  public:
+    VescUartApiStatic(HardwareSerial *uart) : VescUartApi(rxbuf, RxBytes, uart) { }
+};
+
+// batch for the scope of this object, e.g. { VescBatch<64> b(&vesc); vesc.setCurrent(...); vesc.askValues(); }
+template <vua_size_t Bytes>
+class VescBatch {
+  private:
+    VescUartApi *vesc;
+    uint8_t buf[Bytes];
+  public:
+    VescBatch(VescUartApi *vesc) : vesc(vesc) { vesc->beginBatch(buf, Bytes); }
+    ~VescBatch() { vesc->endBatch(); }
+};
+
 #endif // _VESCUARTAPI_H_